@@ -0,0 +1,36 @@
+#!/usr/bin/env bash
+# Sweep order, refinement, assembly level and solver (ODE solver for heat,
+# linear solver for ex1-modified) and append the phase timings to a CSV file
+# (default: benchmark.csv).
+#
+# Usage: HEAT=./heat EX1=./ex1-modified ./benchmark.sh [output.csv]
+
+set -e
+
+OUT=${1:-benchmark.csv}
+HEAT=${HEAT:-./heat}
+EX1=${EX1:-./ex1-modified}
+ORDERS=${ORDERS:-"1 2 3"}
+REFINE=${REFINE:-"3 4 5"}
+# ex1 solvers: Gauss-Seidel PCG (UMFPACK when MFEM is built with SuiteSparse,
+# a build-time choice), multigrid-preconditioned CG, mixed-precision CG
+EX1_SOLVERS=${EX1_SOLVERS:-"-no-mg -mg -mp"}
+
+for o in $ORDERS; do
+   for pa in -no-pa -pa; do
+      # ex1 refines from the coarse mesh and logs every level, with the
+      # solver name in each row
+      for solver in $EX1_SOLVERS; do
+         # mixed precision needs the assembled matrix
+         if [ "$pa" = -pa ] && [ "$solver" = -mp ]; then continue; fi
+         "$EX1" -o $o -r ${REFINE##* } $pa $solver -no-vis -bf "$OUT" > /dev/null
+      done
+      for r in $REFINE; do
+         # implicit (SDIRK) and explicit (RK4) time stepping
+         for s in 21 4; do
+            "$HEAT" -o $o -r $r $pa -s $s -dt 1e-5 -tf 1e-4 -bf "$OUT" > /dev/null
+         done
+      done
+   done
+done
+echo "Results appended to $OUT"
@@ -65,8 +65,10 @@
 //               optional connection to the GLVis tool for visualization.
 
 #include "mfem.hpp"
+#include "helper.hpp"
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
 using namespace std;
 using namespace mfem;
@@ -77,41 +79,708 @@ using namespace mfem;
 /// @param marker A function that takes the midpoint coordinate as input and returns true for boundaries to be marked.
 /// @example MarkBoundaries(mesh, 5, [](const Vector &x) { return x[0] < 1e-9; });
 /// This example marks boundaries where the x-coordinate is nearly zero, accounting for numerical errors.
+/// To mark several regions, add one rule each to a BoundaryTagger (see helper.hpp), which marks all of them in one pass.
 void MarkBoundaries(Mesh &mesh, int attr,
                     std::function<bool(const Vector &x)> marker)
 {
-   const int dim = mesh.SpaceDimension();
-   Vector center(mesh.SpaceDimension());
-   Array<int> vertices;
-   for (int i=0; i<mesh.GetNBE(); i++)
+   BoundaryTagger tagger(mesh);
+   tagger.AddRule(attr, marker);
+   tagger.Apply();
+}
+
+/// @brief Time boundary tagging with several rules on a strip of about
+/// @a num_faces boundary elements: one pass per rule, as MarkBoundaries did
+/// before BoundaryTagger, and BoundaryTagger with 1 and @a num_threads
+/// threads.
+void BoundaryTaggingBenchmark(int num_faces, int num_threads)
+{
+   // nx x 1 quadrilaterals have 2 nx + 2 boundary edges
+   const int nx = max(1, num_faces/2 - 1);
+   Mesh mesh = Mesh::MakeCartesian2D(nx, 1, Element::QUADRILATERAL, false,
+                                     1.0, 1.0);
+   const int nbe = mesh.GetNBE();
+
+   // Eight overlapping bands in x, the last matching one wins, and the top
+   std::vector<pair<int, BoundaryTagger::Predicate>> rules;
+   for (int k=0; k<8; k++)
    {
-      center = 0.0;
-      mesh.GetBdrElement(i)->GetVertices(vertices);
-      for (auto v:vertices)
+      rules.emplace_back(5 + k, [k](const Vector &x) { return x[0] >= k/8.0; });
+   }
+   rules.emplace_back(20, [](const Vector &x) { return x[1] > 0.5; });
+
+   // One pass, with a Vector and Array per element, and SetAttributes() per
+   // rule
+   auto mark_per_rule = [&mesh](int attr,
+                                const BoundaryTagger::Predicate &marker)
+   {
+      const int dim = mesh.SpaceDimension();
+      Vector center(dim);
+      Array<int> vertices;
+      for (int i=0; i<mesh.GetNBE(); i++)
       {
-         real_t * coord = mesh.GetVertex(v);
-         for (int d=0; d<dim; d++)
+         center = 0.0;
+         mesh.GetBdrElement(i)->GetVertices(vertices);
+         for (auto v:vertices)
          {
-            center[d] += coord[d];
+            real_t *coord = mesh.GetVertex(v);
+            for (int d=0; d<dim; d++) { center[d] += coord[d]; }
          }
+         center *= 1.0 / vertices.Size();
+         if (marker(center)) { mesh.SetBdrAttribute(i, attr); }
+      }
+      mesh.SetAttributes();
+   };
+   auto reset = [&mesh, nbe]()
+   {
+      for (int i=0; i<nbe; i++) { mesh.SetBdrAttribute(i, 1); }
+      mesh.SetAttributes();
+   };
+
+   cout << "Boundary elements: " << nbe << ", rules: " << rules.size() << endl;
+   cout << setw(28) << "method" << setw(14) << "time [s]" << setw(16)
+        << "elements/s" << setw(12) << "mismatch" << endl;
+   Array<int> reference(nbe);
+   auto report = [&](const string &name, real_t time, bool is_reference)
+   {
+      int mismatch = 0;
+      for (int i=0; i<nbe; i++)
+      {
+         if (is_reference) { reference[i] = mesh.GetBdrAttribute(i); }
+         else if (reference[i] != mesh.GetBdrAttribute(i)) { mismatch++; }
+      }
+      cout << setw(28) << name << setw(14) << time << setw(16) << nbe / time
+           << setw(12) << mismatch << endl;
+   };
+
+   StopWatch sw;
+   reset();
+   sw.Start();
+   for (auto &rule : rules) { mark_per_rule(rule.first, rule.second); }
+   sw.Stop();
+   report("one pass per rule", sw.RealTime(), true);
+
+   for (int threads : {1, num_threads})
+   {
+      reset();
+      BoundaryTagger tagger(mesh, threads);
+      for (auto &rule : rules) { tagger.AddRule(rule.first, rule.second); }
+      sw.Clear();
+      sw.Start();
+      tagger.Apply();
+      sw.Stop();
+      report("tagger, " + to_string(threads) + " thread(s)", sw.RealTime(),
+             false);
+      // Again, with the centroids of the first call
+      reset();
+      sw.Clear();
+      sw.Start();
+      tagger.Apply();
+      sw.Stop();
+      report("  centroids reused", sw.RealTime(), false);
+   }
+}
+
+// Source and exact solution at the point (x, y, z). They take coordinates
+// instead of a Vector so that the batched coefficients can inline them.
+inline real_t rhs_func(real_t x, real_t y, real_t)
+{
+   return M_PI*M_PI*2.0*sin(M_PI*x)*sin(M_PI*y);
+}
+
+inline real_t u_func(real_t x, real_t y, real_t)
+{
+   return sin(M_PI*x)*sin(M_PI*y);
+}
+
+/// @brief V-cycle geometric multigrid for the convection-diffusion operator.
+///
+/// Levels are added one at a time with AddFinestLevel() as the hierarchy is
+/// refined, so the operators and smoothers of the coarser levels are kept
+/// between solves. The coarsest level is fully assembled and solved directly.
+/// Finer levels use partial assembly if requested and are smoothed by
+/// symmetric Gauss-Seidel (full assembly only) or Chebyshev iteration.
+class ConvectionDiffusionMultigrid : public GeometricMultigrid
+{
+public:
+   enum SmootherType { GAUSS_SEIDEL, CHEBYSHEV };
+
+private:
+   FiniteElementSpaceHierarchy &hierarchy;
+   Array<int> ess_bdr;
+   Coefficient &eps;
+   VectorCoefficient &beta;
+   const bool pa;
+   const SmootherType smoother_type;
+
+   BilinearForm *NewForm(FiniteElementSpace &fes, bool partial)
+   {
+      BilinearForm *form = new BilinearForm(&fes);
+      if (partial) { form->SetAssemblyLevel(AssemblyLevel::PARTIAL); }
+      form->AddDomainIntegrator(new DiffusionIntegrator(eps));
+      form->AddDomainIntegrator(new ConvectionIntegrator(beta));
+      form->Assemble();
+      return form;
+   }
+
+   // The multigrid object owns the level operator from now on
+   void AppendLevel(OperatorPtr &A, Solver *solver)
+   {
+      const bool own = A.OwnsOperator();
+      A.SetOperatorOwner(false);
+      AddLevel(A.Ptr(), solver, own, true);
+   }
+
+   // Essential dofs of the levels added to the hierarchy since the last call
+   void UpdateEssentialDofs()
+   {
+      for (int l = essentialTrueDofs.Size(); l < hierarchy.GetNumLevels(); l++)
+      {
+         essentialTrueDofs.Append(new Array<int>);
+         hierarchy.GetFESpaceAtLevel(l).GetEssentialTrueDofs(
+            ess_bdr, *essentialTrueDofs.Last());
+      }
+   }
+
+   void ConstructCoarseLevel()
+   {
+      bfs.Append(NewForm(hierarchy.GetFESpaceAtLevel(0), false));
+      OperatorPtr A(Operator::MFEM_SPARSEMAT);
+      bfs[0]->FormSystemMatrix(*essentialTrueDofs[0], A);
+#ifdef MFEM_USE_SUITESPARSE
+      UMFPackSolver *coarse_solver = new UMFPackSolver;
+      coarse_solver->SetOperator(*A);
+#else
+      // The coarse mesh is small, so a dense LU factorization is sufficient
+      DenseMatrix dense;
+      A.As<SparseMatrix>()->ToDenseMatrix(dense);
+      DenseMatrixInverse *coarse_solver = new DenseMatrixInverse(dense);
+#endif
+      AppendLevel(A, coarse_solver);
+   }
+
+public:
+   ConvectionDiffusionMultigrid(FiniteElementSpaceHierarchy &hierarchy,
+                                const Array<int> &ess_bdr, Coefficient &eps,
+                                VectorCoefficient &beta, bool pa,
+                                SmootherType smoother_type)
+      : GeometricMultigrid(hierarchy, ess_bdr), hierarchy(hierarchy),
+        ess_bdr(ess_bdr), eps(eps), beta(beta), pa(pa),
+        smoother_type(smoother_type)
+   {
+      MFEM_VERIFY(!pa || smoother_type == CHEBYSHEV,
+                  "Gauss-Seidel smoothing requires an assembled matrix");
+      SetCycleType(CycleType::VCYCLE, 1, 1);
+      UpdateEssentialDofs();
+      ConstructCoarseLevel();
+      while (NumLevels() < hierarchy.GetNumLevels()) { AddFinestLevel(); }
+   }
+
+   using GeometricMultigrid::FormFineLinearSystem;
+
+   /// FormFineLinearSystem() that keeps the interior values of @a x as the
+   /// initial guess X if @a copy_interior is nonzero, for nested iteration.
+   void FormFineLinearSystem(Vector &x, Vector &b, OperatorHandle &A,
+                             Vector &X, Vector &B, int copy_interior)
+   {
+      bfs.Last()->FormLinearSystem(*essentialTrueDofs.Last(), x, b, A, X, B,
+                                   copy_interior);
+   }
+
+   /// Add the next level of the hierarchy, e.g. after
+   /// FiniteElementSpaceHierarchy::AddUniformlyRefinedLevel().
+   void AddFinestLevel()
+   {
+      const int level = NumLevels();
+      MFEM_VERIFY(level < hierarchy.GetNumLevels(), "No new level to add");
+      FiniteElementSpace &fes = hierarchy.GetFESpaceAtLevel(level);
+      UpdateEssentialDofs();
+      const Array<int> &ess_tdof_list = *essentialTrueDofs[level];
+
+      bfs.Append(NewForm(fes, pa));
+      OperatorPtr A(pa ? Operator::ANY_TYPE : Operator::MFEM_SPARSEMAT);
+      bfs.Last()->FormSystemMatrix(ess_tdof_list, A);
+
+      Solver *smoother;
+      if (smoother_type == GAUSS_SEIDEL)
+      {
+         smoother = new GSSmoother(*A.As<SparseMatrix>());
+      }
+      else
+      {
+         Vector diag(fes.GetTrueVSize());
+         bfs.Last()->AssembleDiagonal(diag);
+         smoother = new OperatorChebyshevSmoother(*A, diag, ess_tdof_list, 2);
+      }
+      AppendLevel(A, smoother);
+   }
+};
+
+/// Parameters (eps, bx, by) of one problem of a sweep
+struct SweepParameters
+{
+   real_t eps, bx, by;
+};
+
+/// Read one "eps bx by" tuple per line; '#' starts a comment.
+std::vector<SweepParameters> ReadSweepParameters(const char *filename)
+{
+   ifstream file(filename);
+   MFEM_VERIFY(file, "Cannot open " << filename);
+   std::vector<SweepParameters> params;
+   std::string line;
+   while (getline(file, line))
+   {
+      line = line.substr(0, line.find('#'));
+      istringstream is(line);
+      SweepParameters p;
+      if (is >> p.eps >> p.bx >> p.by) { params.push_back(p); }
+   }
+   return params;
+}
+
+/// @brief Solve -eps Delta u + b.grad u = f for each parameter tuple on
+/// fespace and print the errors as a table.
+///
+/// Diffusion and the two convection directions are assembled once; each
+/// system is eps D + bx Cx + by Cy on their merged pattern. The solves run on
+/// @a num_threads threads, each with its own matrix values, right-hand side
+/// and solver. Errors are computed afterwards on the calling thread, since
+/// element transformations are not thread-safe.
+void SolveSweep(FiniteElementSpace &fespace, LinearForm &b, Coefficient &u,
+                Array<int> &ess_bdr, const std::vector<SweepParameters> &params,
+                int num_threads)
+{
+   StopWatch sw;
+   sw.Start();
+   BilinearForm diffusion(&fespace), convection_x(&fespace),
+                convection_y(&fespace);
+   Vector e_x(2), e_y(2);
+   e_x(0) = 1.0; e_x(1) = 0.0;
+   e_y(0) = 0.0; e_y(1) = 1.0;
+   VectorConstantCoefficient e_x_cf(e_x), e_y_cf(e_y);
+   diffusion.AddDomainIntegrator(new DiffusionIntegrator());
+   convection_x.AddDomainIntegrator(new ConvectionIntegrator(e_x_cf));
+   convection_y.AddDomainIntegrator(new ConvectionIntegrator(e_y_cf));
+   SparseMatrixSum sum;
+   for (BilinearForm *form : {&diffusion, &convection_x, &convection_y})
+   {
+      form->Assemble();
+      form->Finalize();
+      sum.AddTerm(form->SpMat());
+   }
+   b.Assemble();
+
+   Array<int> ess_tdof_list;
+   fespace.GetEssentialTrueDofs(ess_bdr, ess_tdof_list);
+   GridFunction x(&fespace);
+   x = 0.0;
+   x.ProjectBdrCoefficient(u, ess_bdr);
+   // Build the merged pattern before the threads share it
+   const real_t coeff0[] = {1.0, 0.0, 0.0};
+   sum.Update(coeff0);
+   sw.Stop();
+   const real_t setup_time = sw.RealTime();
+
+   const int n = int(params.size());
+   std::vector<Vector> solutions(n);
+   std::vector<int> iterations(n);
+   sw.Clear();
+   sw.Start();
+   ParallelFor(n, num_threads, [&](int k)
+   {
+      const SweepParameters &p = params[k];
+      const real_t coeff[] = {p.eps, p.bx, p.by};
+      unique_ptr<SparseMatrix> A(sum.NewCombination(coeff));
+      Vector B(b);
+      Vector &X = solutions[k];
+      X = x;
+      A->EliminateRowCol(ess_tdof_list, X, B);
+
+      GSSmoother M(*A);
+      unique_ptr<IterativeSolver> solver;
+      if (p.bx*p.bx + p.by*p.by == 0.0)
+      {
+         solver.reset(new CGSolver);
+         solver->SetAbsTol(0.0);
       }
-      center *= 1.0 / vertices.Size();
-      if (marker(center))
+      else
       {
-         mesh.SetBdrAttribute(i, attr);
+         GMRESSolver *gmres = new GMRESSolver;
+         gmres->SetKDim(50);
+         solver.reset(gmres);
+         solver->SetAbsTol(1e-12);
       }
+      solver->SetRelTol(1e-6);
+      solver->SetMaxIter(3000);
+      solver->SetPrintLevel(0);
+      solver->SetPreconditioner(M);
+      solver->SetOperator(*A);
+      solver->Mult(B, X);
+      iterations[k] = solver->GetNumIterations();
+   });
+   sw.Stop();
+   const real_t solve_time = sw.RealTime();
+
+   out << setw(12) << "eps" << setw(12) << "bx" << setw(12) << "by"
+       << setw(12) << "iterations" << setw(16) << "L2 error" << endl;
+   for (int k=0; k<n; k++)
+   {
+      x = solutions[k];
+      out << setw(12) << params[k].eps << setw(12) << params[k].bx
+          << setw(12) << params[k].by << setw(12) << iterations[k]
+          << setw(16) << x.ComputeL2Error(u) << endl;
    }
-   mesh.SetAttributes();
+   out << "Sweep of " << n << " problems with " << fespace.GetTrueVSize()
+       << " unknowns: setup " << setup_time << " s, solves " << solve_time
+       << " s on " << max(1, min(num_threads, n)) << " threads" << endl;
 }
 
-double rhs_func(const Vector &x)
+/// @brief Solve the Laplace problem for @a num_rhs load cases, once column by
+/// column with Jacobi PCG and once as a block with LockstepCG, and compare.
+///
+/// Load case k uses the source sin(m pi x) sin(n pi y), where (m, n) runs
+/// over 1, 2, 3, ... in both directions; all cases share the boundary data u.
+void SolveMultipleRHS(BilinearForm &a, GridFunction &x,
+                      Coefficient &u, Array<int> &ess_bdr, int num_rhs)
 {
-   return M_PI*M_PI*2.0*sin(M_PI*x[0])*sin(M_PI*x[1]);
+   FiniteElementSpace &fespace = *a.FESpace();
+   Array<int> ess_tdof_list;
+   fespace.GetEssentialTrueDofs(ess_bdr, ess_tdof_list);
+   x = 0.0;
+   x.ProjectBdrCoefficient(u, ess_bdr);
+   a.Assemble();
+   OperatorPtr A;
+   a.FormSystemMatrix(ess_tdof_list, A);
+   const SparseMatrix &Amat = *A.As<SparseMatrix>();
+
+   // Right-hand sides as the columns of one block
+   const int n = fespace.GetTrueVSize();
+   DenseMatrix B(n, num_rhs), X(n, num_rhs);
+   const int modes = int(ceil(sqrt(real_t(num_rhs))));
+   for (int k=0; k<num_rhs; k++)
+   {
+      const real_t m = 1 + k % modes, l = 1 + k / modes;
+      auto f = MakeBatchedCoefficient([m, l](real_t x, real_t y, real_t)
+      {
+         return sin(m*M_PI*x)*sin(l*M_PI*y);
+      });
+      LinearForm b_k(&fespace);
+      b_k.AddDomainIntegrator(new BatchedDomainLFIntegrator(f));
+      b_k.Assemble();
+      a.EliminateVDofsInRHS(ess_tdof_list, x, b_k);
+      Vector column(B.GetColumn(k), n);
+      column = b_k;
+      Vector x_k(X.GetColumn(k), n);
+      x_k = x;
+   }
+   DenseMatrix X0(X);
+
+   // Column by column
+   StopWatch sw;
+   sw.Start();
+   DSmoother jacobi(Amat);
+   CGSolver cg;
+   cg.SetRelTol(1e-6);
+   cg.SetAbsTol(0.0);
+   cg.SetMaxIter(2000);
+   cg.SetPrintLevel(0);
+   cg.SetPreconditioner(jacobi);
+   cg.SetOperator(Amat);
+   int seq_iterations = 0;
+   for (int k=0; k<num_rhs; k++)
+   {
+      Vector b_k(B.GetColumn(k), n), x_k(X.GetColumn(k), n);
+      cg.Mult(b_k, x_k);
+      seq_iterations += cg.GetNumIterations();
+   }
+   sw.Stop();
+   const real_t seq_time = sw.RealTime();
+   DenseMatrix X_seq(X);
+
+   // All columns in lock-step
+   X = X0;
+   sw.Clear();
+   sw.Start();
+   LockstepCG block_cg;
+   block_cg.SetRelTol(1e-6);
+   block_cg.SetMaxIter(2000);
+   block_cg.SetOperator(Amat);
+   block_cg.Mult(B, X);
+   sw.Stop();
+   const real_t block_time = sw.RealTime();
+
+   int block_iterations = 0;
+   for (int it : block_cg.GetNumIterations()) { block_iterations += it; }
+   X_seq -= X;
+   out << "Load cases: " << num_rhs << ", unknowns: " << n << "\n"
+       << "sequential PCG: " << seq_time << " s, " << num_rhs / seq_time
+       << " RHS/s, " << seq_iterations << " iterations\n"
+       << "lock-step PCG:  " << block_time << " s, " << num_rhs / block_time
+       << " RHS/s, " << block_iterations << " iterations\n"
+       << "max difference: " << X_seq.MaxMaxNorm() << endl;
+}
+
+/// Orderings of the unknowns for SolveReordered().
+enum DofOrdering { NATURAL, RCM, DOWNWIND };
+/// Preconditioners of GMRES in SolveReordered().
+enum ConvectionPreconditioner { GAUSS_SEIDEL, ILU_K };
+
+/// @brief Permutation of the unknowns of @a fespace for @a ordering: reverse
+/// Cuthill-McKee on the graph of @a A, or increasing beta . x at the dofs.
+/// Empty for the natural order.
+void ComputeDofOrdering(int ordering, const SparseMatrix &A,
+                        FiniteElementSpace &fespace, const Vector &beta,
+                        Array<int> &perm)
+{
+   perm.SetSize(0);
+   if (ordering == RCM)
+   {
+      ReverseCuthillMcKee(A, perm);
+   }
+   else if (ordering == DOWNWIND)
+   {
+      // Nodal values of beta . x are the dof positions along the flow
+      FunctionCoefficient along_flow([&beta](const Vector &x)
+      {
+         return beta * x;
+      });
+      GridFunction s(&fespace);
+      s.ProjectCoefficient(along_flow);
+      DownwindOrdering(s, perm);
+   }
+}
+
+/// Cost and convergence of one SolveReordered() call.
+struct ReorderedSolveStats
+{
+   int iterations;
+   bool converged;
+   real_t setup_time, solve_time;
+   real_t spmv_bandwidth; // GB/s of A.Mult with the reordered matrix
+   int matrix_bandwidth;  // max |i - j| of the reordered matrix
+};
+
+/// @brief Solve A X = B with GMRES(50) after permuting the unknowns by
+/// @a perm (none if empty), preconditioned with @a precond.
+ReorderedSolveStats SolveReordered(const SparseMatrix &A, const Vector &B,
+                                   Vector &X, const Array<int> &perm,
+                                   int precond, int ilu_level, real_t rel_tol,
+                                   int print_level)
+{
+   ReorderedSolveStats stats;
+   StopWatch sw;
+   sw.Start();
+   unique_ptr<SparseMatrix> A_perm;
+   const SparseMatrix *Ar = &A;
+   Vector Br(B), Xr(X);
+   if (perm.Size())
+   {
+      A_perm.reset(PermuteSparseMatrix(A, perm));
+      Ar = A_perm.get();
+      for (int i=0; i<perm.Size(); i++)
+      {
+         Br[i] = B[perm[i]];
+         Xr[i] = X[perm[i]];
+      }
+   }
+   unique_ptr<Solver> M;
+   switch (precond)
+   {
+      case GAUSS_SEIDEL: M.reset(new GSSmoother(*Ar)); break;
+      case ILU_K: M.reset(new ILUK(*Ar, ilu_level)); break;
+   }
+   sw.Stop();
+   stats.setup_time = sw.RealTime();
+
+   GMRESSolver gmres;
+   gmres.SetKDim(50);
+   gmres.SetPrintLevel(print_level);
+   gmres.SetMaxIter(3000);
+   gmres.SetRelTol(rel_tol);
+   gmres.SetAbsTol(1e-12);
+   gmres.SetPreconditioner(*M);
+   gmres.SetOperator(*Ar);
+   sw.Clear();
+   sw.Start();
+   {
+      TraceScope trace("SolveReordered", "solver");
+      gmres.Mult(Br, Xr);
+      trace.Arg(gmres);
+   }
+   sw.Stop();
+   stats.solve_time = sw.RealTime();
+   stats.iterations = gmres.GetNumIterations();
+   stats.converged = gmres.GetConverged();
+   if (perm.Size())
+   {
+      for (int i=0; i<perm.Size(); i++) { X[perm[i]] = Xr[i]; }
+   }
+   else { X = Xr; }
+
+   // Streamed bytes of one product: the CSR arrays, x and y once each
+   const int reps = 20;
+   Vector y(Ar->Height());
+   sw.Clear();
+   sw.Start();
+   for (int r=0; r<reps; r++) { Ar->Mult(Xr, y); }
+   sw.Stop();
+   const real_t bytes = real_t(Ar->NumNonZeroElems())*(sizeof(real_t) +
+                                                       sizeof(int)) +
+                        real_t(Ar->Height() + 1)*sizeof(int) +
+                        2.0*Ar->Height()*sizeof(real_t);
+   stats.spmv_bandwidth = reps*bytes / sw.RealTime() / 1e9;
+   stats.matrix_bandwidth = MatrixBandwidth(*Ar);
+   return stats;
+}
+
+/// @brief Compare orderings and preconditioners for the convection-diffusion
+/// problem on @a fespace with velocity @a beta, for decreasing diffusion,
+/// i.e. increasing mesh Peclet number |beta| h / (2 eps).
+void PecletBenchmark(FiniteElementSpace &fespace, LinearForm &b,
+                     Coefficient &u, Array<int> &ess_bdr, const Vector &beta,
+                     int ilu_level)
+{
+   // A = eps D + C, with D and C assembled once
+   BilinearForm diffusion(&fespace), convection(&fespace);
+   VectorConstantCoefficient beta_cf(beta);
+   diffusion.AddDomainIntegrator(new DiffusionIntegrator());
+   convection.AddDomainIntegrator(new ConvectionIntegrator(beta_cf));
+   SparseMatrixSum sum;
+   for (BilinearForm *form : {&diffusion, &convection})
+   {
+      form->Assemble();
+      form->Finalize();
+      sum.AddTerm(form->SpMat());
+   }
+   b.Assemble();
+   Array<int> ess_tdof_list;
+   fespace.GetEssentialTrueDofs(ess_bdr, ess_tdof_list);
+   GridFunction x(&fespace);
+   x = 0.0;
+   x.ProjectBdrCoefficient(u, ess_bdr);
+
+   real_t hmin, hmax, kmin, kmax;
+   fespace.GetMesh()->GetCharacteristics(hmin, hmax, kmin, kmax);
+   const char *ordering_names[] = {"natural", "RCM", "downwind"};
+   const string ilu_name = "ILU(" + to_string(ilu_level) + ")";
+   const char *precond_names[] = {"GS", ilu_name.c_str()};
+   const int configs[][2] =
+   {
+      {NATURAL, GAUSS_SEIDEL}, {NATURAL, ILU_K}, {RCM, ILU_K},
+      {DOWNWIND, GAUSS_SEIDEL}, {DOWNWIND, ILU_K}
+   };
+
+   out << "Unknowns: " << fespace.GetTrueVSize() << ", beta = (" << beta[0]
+       << ", " << beta[1] << "), h = " << hmax << endl;
+   out << setw(10) << "Peclet" << setw(10) << "ordering" << setw(10)
+       << "precond" << setw(8) << "its" << setw(12) << "setup [s]"
+       << setw(12) << "solve [s]" << setw(12) << "SpMV GB/s" << setw(10)
+       << "band" << setw(12) << "L2 error" << endl;
+   for (real_t eps : {1.0, 1e-1, 1e-2, 1e-3, 1e-4})
+   {
+      const real_t coeff[] = {eps, 1.0};
+      unique_ptr<SparseMatrix> A(sum.NewCombination(coeff));
+      Vector B(b), X(x);
+      A->EliminateRowCol(ess_tdof_list, X, B);
+      const Vector X0(X);
+      for (const auto &config : configs)
+      {
+         Array<int> perm;
+         ComputeDofOrdering(config[0], *A, fespace, beta, perm);
+         X = X0;
+         const ReorderedSolveStats stats =
+            SolveReordered(*A, B, X, perm, config[1], ilu_level, 1e-6, 0);
+         GridFunction x_sol(&fespace, X.GetData());
+         out << setw(10) << beta.Norml2()*hmax/(2*eps) << setw(10)
+             << ordering_names[config[0]] << setw(10)
+             << precond_names[config[1]] << setw(8)
+             << (stats.converged ? to_string(stats.iterations) : "-")
+             << setw(12) << stats.setup_time << setw(12) << stats.solve_time
+             << setw(12) << stats.spmv_bandwidth << setw(10)
+             << stats.matrix_bandwidth << setw(12) << x_sol.ComputeL2Error(u)
+             << endl;
+      }
+   }
 }
 
-double u_func(const Vector &x)
+/// @brief Solve the symmetric problem of @a a on the finest mesh with
+/// Gauss-Seidel PCG in double precision and with MixedPrecisionCG, and print
+/// the memory, time, iterations and errors of both.
+void MixedPrecisionBenchmark(BilinearForm &a, LinearForm &b, GridFunction &x,
+                             Coefficient &u, Array<int> &ess_bdr)
 {
-   return sin(M_PI*x[0])*sin(M_PI*x[1]);
+   FiniteElementSpace &fespace = *a.FESpace();
+   Array<int> ess_tdof_list;
+   fespace.GetEssentialTrueDofs(ess_bdr, ess_tdof_list);
+   x = 0.0;
+   x.ProjectBdrCoefficient(u, ess_bdr);
+   a.Assemble();
+   b.Assemble();
+   OperatorPtr A;
+   Vector B, X;
+   a.FormLinearSystem(ess_tdof_list, x, b, A, X, B);
+   const SparseMatrix &Amat = *A.As<SparseMatrix>();
+   const Vector X0(X);
+   const int n = Amat.Height();
+   const real_t MB = 1e-6;
+   const real_t matrix_bytes = real_t(Amat.NumNonZeroElems())*(sizeof(real_t) +
+                                                               sizeof(int)) +
+                               real_t(n + 1)*sizeof(int);
+
+   out << "Unknowns: " << n << ", nonzeros: " << Amat.NumNonZeroElems()
+       << ", matrix: " << matrix_bytes*MB << " MB" << endl;
+   out << setw(10) << "solver" << setw(12) << "extra MB" << setw(12)
+       << "setup [s]" << setw(12) << "solve [s]" << setw(8) << "its"
+       << setw(8) << "refs" << setw(14) << "residual" << setw(14)
+       << "L2 error" << endl;
+   Vector X_double;
+   for (bool mixed : {false, true})
+   {
+      StopWatch sw;
+      sw.Start();
+      unique_ptr<GSSmoother> gs;
+      unique_ptr<IterativeSolver> solver;
+      MixedPrecisionCG *mpcg = nullptr;
+      if (mixed)
+      {
+         solver.reset(mpcg = new MixedPrecisionCG);
+      }
+      else
+      {
+         gs.reset(new GSSmoother(Amat));
+         solver.reset(new CGSolver);
+         solver->SetPreconditioner(*gs);
+      }
+      solver->SetRelTol(1e-10);
+      solver->SetAbsTol(0.0);
+      solver->SetMaxIter(10000);
+      solver->SetPrintLevel(0);
+      solver->SetOperator(Amat);
+      sw.Stop();
+      const real_t setup_time = sw.RealTime();
+      X = X0;
+      sw.Clear();
+      sw.Start();
+      solver->Mult(B, X);
+      sw.Stop();
+      // Work vectors: 4 of CG in double; the float copy and vectors of
+      // MixedPrecisionCG, which also keeps the double matrix for residuals
+      const real_t extra_bytes = mixed ? mpcg->MemoryBytes() :
+                                 4.0*n*sizeof(real_t);
+      Vector r(n);
+      Amat.Mult(X, r);
+      r -= B;
+      a.RecoverFEMSolution(X, b, x);
+      out << setw(10) << (mixed ? "mixed" : "double") << setw(12)
+          << extra_bytes*MB << setw(12) << setup_time << setw(12)
+          << sw.RealTime() << setw(8) << solver->GetNumIterations()
+          << setw(8) << (mixed ? mpcg->GetNumRefinements() : 0) << setw(14)
+          << r.Norml2() / B.Norml2() << setw(14) << x.ComputeL2Error(u)
+          << endl;
+      if (!mixed) { X_double = X; }
+   }
+   X -= X_double;
+   out << "Max difference of the solutions: " << X.Normlinf() << endl;
 }
 
 int main(int argc, char *argv[])
@@ -125,6 +794,23 @@ int main(int argc, char *argv[])
    const char *device_config = "cpu";
    bool visualization = true;
    bool algebraic_ceed = false;
+   int ref_levels = 4;
+   const char *benchmark_file = "";
+   const char *trace_file = "";
+   bool multigrid = false;
+   int mg_smoother = -1;
+   bool nested = false;
+   const char *sweep_file = "";
+   int num_threads = 1;
+   int num_rhs = 0;
+   int boundary_benchmark = 0;
+   int reorder = NATURAL;
+   int conv_prec = GAUSS_SEIDEL;
+   int ilu_level = 0;
+   bool peclet_benchmark = false;
+   bool mixed_precision = false;
+   bool mixed_benchmark = false;
+   const char *cache_dir = "";
 
    double eps = 1.0; // diffusion strengh
    double bx = 0.0; // convection x-direction
@@ -142,6 +828,8 @@ int main(int argc, char *argv[])
    args.AddOption(&order, "-o", "--order",
                   "Finite element order (polynomial degree) or -1 for"
                   " isoparametric space.");
+   args.AddOption(&ref_levels, "-r", "--refine",
+                  "Number of uniform refinements, each followed by a solve.");
    args.AddOption(&static_cond, "-sc", "--static-condensation", "-no-sc",
                   "--no-static-condensation", "Enable static condensation.");
    args.AddOption(&pa, "-pa", "--partial-assembly", "-no-pa",
@@ -157,6 +845,53 @@ int main(int argc, char *argv[])
    args.AddOption(&visualization, "-vis", "--visualization", "-no-vis",
                   "--no-visualization",
                   "Enable or disable GLVis visualization.");
+   args.AddOption(&multigrid, "-mg", "--multigrid", "-no-mg", "--no-multigrid",
+                  "Precondition with a V-cycle on the refinement hierarchy.");
+   args.AddOption(&mg_smoother, "-mgs", "--mg-smoother",
+                  "Multigrid smoother: 0 - symmetric Gauss-Seidel, "
+                  "1 - Chebyshev; default: Gauss-Seidel, Chebyshev with -pa.");
+   args.AddOption(&nested, "-ni", "--nested-iteration", "-no-ni",
+                  "--no-nested-iteration",
+                  "Start each level from the previous solution and stop at "
+                  "the discretization error.");
+   args.AddOption(&sweep_file, "-sw", "--sweep",
+                  "Solve for each 'eps bx by' line of this file on the finest "
+                  "mesh and print a table of errors.");
+   args.AddOption(&num_threads, "-nt", "--num-threads",
+                  "Number of threads for the sweep and the load assembly.");
+   args.AddOption(&num_rhs, "-nrhs", "--num-rhs",
+                  "Solve this many load cases on the finest mesh, sequentially "
+                  "and as one block, and compare the throughput.");
+   args.AddOption(&boundary_benchmark, "-btb", "--boundary-tagging-benchmark",
+                  "Time boundary tagging on a mesh with about this many "
+                  "boundary elements and exit.");
+   args.AddOption(&reorder, "-ro", "--reorder",
+                  "Ordering of the unknowns for GMRES: 0 - natural, "
+                  "1 - reverse Cuthill-McKee, 2 - downwind along beta.");
+   args.AddOption(&conv_prec, "-cpc", "--convection-preconditioner",
+                  "Preconditioner of GMRES with -ro: 0 - Gauss-Seidel, "
+                  "1 - ILU(k).");
+   args.AddOption(&ilu_level, "-ilu", "--ilu-level",
+                  "Level of fill k of ILU(k).");
+   args.AddOption(&peclet_benchmark, "-peb", "--peclet-benchmark", "-no-peb",
+                  "--no-peclet-benchmark",
+                  "Compare orderings and preconditioners on the finest mesh "
+                  "for increasing Peclet numbers and exit.");
+   args.AddOption(&mixed_precision, "-mp", "--mixed-precision", "-no-mp",
+                  "--no-mixed-precision",
+                  "Solve the assembled symmetric system with float CG "
+                  "iterations and double-precision iterative refinement.");
+   args.AddOption(&mixed_benchmark, "-mpb", "--mixed-precision-benchmark",
+                  "-no-mpb", "--no-mixed-precision-benchmark",
+                  "Compare the double and mixed-precision solves on the finest "
+                  "mesh and exit.");
+   args.AddOption(&cache_dir, "-oc", "--operator-cache",
+                  "Load the eliminated system matrix of each level from this "
+                  "directory, or store it there after assembly.");
+   args.AddOption(&benchmark_file, "-bf", "--benchmark-file",
+                  "Append the time of each phase to this CSV file.");
+   args.AddOption(&trace_file, "-tr", "--trace",
+                  "Write a Chrome trace of the solver phases to this JSON file.");
    args.Parse();
    if (!args.Good())
    {
@@ -164,6 +899,12 @@ int main(int argc, char *argv[])
       return 1;
    }
    args.PrintOptions(cout);
+   Tracer::Get().Enable(trace_file);
+   if (boundary_benchmark > 0)
+   {
+      BoundaryTaggingBenchmark(boundary_benchmark, num_threads);
+      return 0;
+   }
 
    // 2. Enable hardware devices such as GPUs, and programming models such as
    //    CUDA, OCCA, RAJA and OpenMP based on command line options.
@@ -228,9 +969,16 @@ int main(int argc, char *argv[])
    //    the FEM linear system, which in this case is (1,phi_i) where phi_i are
    //    the basis functions in the finite element fespace.
    LinearForm b(&fespace);
-   FunctionCoefficient f(rhs_func);
-   FunctionCoefficient u(u_func);
-   b.AddDomainIntegrator(new DomainLFIntegrator(f));
+   // Lambdas rather than function pointers, so that the calls are inlined
+   auto f = MakeBatchedCoefficient([](real_t x, real_t y, real_t z)
+   {
+      return rhs_func(x, y, z);
+   });
+   auto u = MakeBatchedCoefficient([](real_t x, real_t y, real_t z)
+   {
+      return u_func(x, y, z);
+   });
+   b.AddDomainIntegrator(new BatchedDomainLFIntegrator(f));
 
    // 8. Define the solution vector x as a finite element grid function
    //    corresponding to fespace. Initialize x with initial guess of zero,
@@ -265,46 +1013,387 @@ int main(int argc, char *argv[])
    //     static condensation, etc.
    if (static_cond) { a.EnableStaticCondensation(); }
 
-   for (int i = 0; i < 4; i++)
+   if (sweep_file[0])
+   {
+      MFEM_VERIFY(!pa && !static_cond,
+                  "The sweep requires full assembly without static condensation");
+      for (int i = 0; i < ref_levels; i++) { mesh.UniformRefinement(); }
+      fespace.Update(false);
+      b.Update();
+      SolveSweep(fespace, b, u, ess_bdr, ReadSweepParameters(sweep_file),
+                 num_threads);
+      if (delete_fec) { delete fec; }
+      return 0;
+   }
+
+   if (num_rhs > 0)
+   {
+      MFEM_VERIFY(!pa && !fa && !static_cond && bx*bx + by*by == 0.0,
+                  "Multiple RHS mode requires the assembled symmetric problem");
+      for (int i = 0; i < ref_levels; i++) { mesh.UniformRefinement(); }
+      fespace.Update(false);
+      a.Update();
+      x.Update();
+      SolveMultipleRHS(a, x, u, ess_bdr, num_rhs);
+      if (delete_fec) { delete fec; }
+      return 0;
+   }
+
+   if (mixed_benchmark)
+   {
+      MFEM_VERIFY(!pa && !fa && !static_cond && bx*bx + by*by == 0.0,
+                  "The mixed-precision benchmark requires the assembled "
+                  "symmetric problem");
+      for (int i = 0; i < ref_levels; i++) { mesh.UniformRefinement(); }
+      fespace.Update(false);
+      a.Update();
+      b.Update();
+      x.Update();
+      MixedPrecisionBenchmark(a, b, x, u, ess_bdr);
+      if (delete_fec) { delete fec; }
+      return 0;
+   }
+   MFEM_VERIFY(reorder >= NATURAL && reorder <= DOWNWIND &&
+               conv_prec >= GAUSS_SEIDEL && conv_prec <= ILU_K,
+               "invalid -ro or -cpc");
+   MFEM_VERIFY(!mixed_precision || (!pa && !multigrid && bx*bx + by*by == 0.0),
+               "-mp requires the assembled symmetric problem");
+   MFEM_VERIFY(!mixed_precision ||
+               (reorder == NATURAL && conv_prec == GAUSS_SEIDEL),
+               "-mp cannot be combined with -ro or -cpc");
+
+   if (peclet_benchmark)
+   {
+      for (int i = 0; i < ref_levels; i++) { mesh.UniformRefinement(); }
+      fespace.Update(false);
+      b.Update();
+      if (beta.Norml2() == 0.0)
+      {
+         beta[0] = 1.0;
+         beta[1] = 0.5;
+      }
+      PecletBenchmark(fespace, b, u, ess_bdr, beta, ilu_level);
+      if (delete_fec) { delete fec; }
+      return 0;
+   }
+
+   // Reordering and ILU replace the Gauss-Seidel preconditioned solve of the
+   // assembled system
+   const bool reordered = !pa && !multigrid &&
+                          (reorder != NATURAL || conv_prec != GAUSS_SEIDEL);
+
+   // The Krylov solver and preconditioner used below, for the benchmark log.
+   std::string solver_name;
+   if (multigrid)
+   {
+      solver_name = bx*bx + by*by == 0.0 ? "mg-pcg" : "mg-gmres";
+   }
+   else if (reordered)
+   {
+      const char *orderings[] = {"", "rcm-", "downwind-"};
+      const char *precs[] = {"gs", "ilu"};
+      solver_name = string(orderings[reorder]) + precs[conv_prec] + "-gmres";
+   }
+   else if (mixed_precision)
+   {
+      solver_name = "mixed-pcg";
+   }
+   else if (!pa)
+   {
+#ifndef MFEM_USE_SUITESPARSE
+      solver_name = bx*bx + by*by == 0.0 ? "gs-pcg" : "gs-gmres";
+#else
+      solver_name = "umfpack";
+#endif
+   }
+   else if (UsesTensorBasis(fespace))
+   {
+      solver_name = algebraic_ceed ? "ceed-pcg" : "jacobi-pcg";
+   }
+   else
+   {
+      solver_name = "cg";
+   }
+   BenchmarkLog bench(benchmark_file, "ex1", order,
+                      pa ? "partial" : (fa ? "full" : "legacy"), solver_name);
+
+   // With -mg, the hierarchy starts from a copy of the unrefined mesh and gets
+   // a new level for each refinement below. The levels repeat the refinements
+   // of mesh, so the finest level numbers its dofs like fespace.
+   unique_ptr<FiniteElementSpaceHierarchy> hierarchy;
+   unique_ptr<ConvectionDiffusionMultigrid> mg;
+   if (multigrid)
    {
+      MFEM_VERIFY(!static_cond, "Multigrid does not support static condensation");
+      if (mg_smoother < 0)
+      {
+         mg_smoother = pa ? ConvectionDiffusionMultigrid::CHEBYSHEV
+                       : ConvectionDiffusionMultigrid::GAUSS_SEIDEL;
+      }
+      Mesh *coarse_mesh = new Mesh(mesh);
+      hierarchy.reset(new FiniteElementSpaceHierarchy(
+                         coarse_mesh, new FiniteElementSpace(coarse_mesh, fec),
+                         true, true));
+      mg.reset(new ConvectionDiffusionMultigrid(
+                  *hierarchy, ess_bdr, eps_cf, beta_cf, pa,
+                  static_cast<ConvectionDiffusionMultigrid::SmootherType>(mg_smoother)));
+   }
+
+   // Krylov iterations of all levels, and their cost in units of one
+   // iteration on the finest level (iterations weighted by the unknowns).
+   int total_iterations = 0;
+   real_t total_work = 0.0;
+   // Threaded load assembly, with the same result as b.Assemble(). The
+   // matrix is assembled once per level, so it is assembled serially.
+   unique_ptr<ThreadedAssembler> b_asm;
+   if (num_threads > 1 && !Device::IsEnabled() && mesh.GetNodes() == nullptr)
+   {
+      b_asm.reset(new ThreadedAssembler(fespace, num_threads));
+      b_asm->AddDomainIntegrator([&f]() -> LinearFormIntegrator*
+      {
+         return new BatchedDomainLFIntegrator(f);
+      });
+   }
+
+   // The system matrix of a level depends on the coarse mesh, the level, the
+   // space, the integrators and the essential boundary. Each cache entry
+   // holds the matrix with the essential dofs eliminated, the eliminated
+   // part (needed for the right-hand side) and the essential dofs.
+   const bool use_cache = cache_dir[0] && !pa && !fa && !static_cond &&
+                          !multigrid;
+   OperatorCache cache(cache_dir);
+   string cache_key;
+   if (use_cache)
+   {
+      ostringstream key;
+      key.precision(17);
+      key << "ex1 mesh=" << OperatorCache::MeshHash(mesh) << " fec="
+          << fec->Name() << " integrators=diffusion(" << eps
+          << "),convection(" << bx << "," << by << ") ess_bdr=";
+      for (int attr : ess_bdr) { key << attr; }
+      cache_key = key.str();
+   }
+
+   for (int i = 0; i < ref_levels; i++)
+   {
+      bench.Start();
       mesh.UniformRefinement();
+      bench.Record("mesh refine", i, 0);
+
+      const string level_key = cache_key + " level=" + to_string(i);
+      unique_ptr<MappedCheckpoint> cached;
+      unique_ptr<SparseMatrix> cached_A, cached_A_e;
+      if (use_cache)
+      {
+         bench.Start();
+         cached = cache.Load(level_key);
+         if (cached)
+         {
+            cached_A.reset(cached->NewSparseMatrix("A"));
+            cached_A_e.reset(cached->NewSparseMatrix("A_e"));
+            bench.Record("operator cache load", i, cached_A->Height());
+         }
+      }
+
+      bench.Start();
       fespace.Update();
       a.Update();
       b.Update();
       x.Update();
+      const long long ndofs = fespace.GetTrueVSize();
+      bench.Record("fespace update", i, ndofs);
+
+      bench.Start();
+      if (!mg && !cached) { a.Assemble(); }
+      {
+         TraceScope trace("LinearForm::Assemble");
+         if (b_asm) { b_asm->Assemble(b); }
+         else { b.Assemble(); }
+      }
+      bench.Record("assemble", i, ndofs);
+
+      if (mg)
+      {
+         // Only the new finest level is assembled; coarser levels are kept
+         bench.Start();
+         hierarchy->AddUniformlyRefinedLevel();
+         MFEM_VERIFY(hierarchy->GetFinestFESpace().GetTrueVSize() == ndofs,
+                     "Multigrid hierarchy does not match fespace");
+         mg->AddFinestLevel();
+         bench.Record("preconditioner setup", i, ndofs);
+      }
 
-      a.Assemble();
-      b.Assemble();
-      x = 0.0;
+      // With nested iteration, x keeps the solution of the previous level,
+      // interpolated by x.Update(), and only the boundary values are reset.
+      // The error of that guess is dominated by the coarse discretization
+      // error, about 2^(p+1) times the one of this level; reducing it by
+      // 0.1/2^(p+1) leaves an algebraic error of 10% of the discretization
+      // error. The first level starts from zero and uses 0.1 h^(p+1).
+      real_t rel_tol = 1e-6;
+      if (nested)
+      {
+         real_t hmin, hmax, kmin, kmax;
+         mesh.GetCharacteristics(hmin, hmax, kmin, kmax);
+         const int p = fespace.GetMaxElementOrder();
+         rel_tol = i == 0 ? 0.1*pow(hmax, p + 1) : 0.1/pow(2.0, p + 1);
+         rel_tol = max(rel_tol, real_t(1e-12));
+      }
+
+      bench.Start();
+      if (!nested) { x = 0.0; }
       x.ProjectBdrCoefficient(u, ess_bdr);
       fespace.GetEssentialTrueDofs(ess_bdr, ess_tdof_list);
 
       OperatorPtr A;
       Vector B, X;
-      a.FormLinearSystem(ess_tdof_list, x, b, A, X, B);
+      if (mg)
+      {
+         mg->FormFineLinearSystem(x, b, A, X, B, nested);
+      }
+      else if (cached)
+      {
+         // What FormLinearSystem does with the assembled matrices: B is b
+         // with the essential columns moved to the right-hand side and the
+         // essential rows set to the boundary values; X and B alias x and b.
+         Array<int> cached_dofs;
+         cached->GetArray("ess_tdofs", cached_dofs);
+         MFEM_VERIFY(cached_A->Height() == fespace.GetTrueVSize() &&
+                     cached_dofs == ess_tdof_list,
+                     "cached operator does not match the space");
+         cached_A_e->AddMult(x, b, -1.0);
+         cached_A->PartMult(ess_tdof_list, x, b);
+         X.MakeRef(x, 0, x.Size());
+         B.MakeRef(b, 0, b.Size());
+         if (!nested) { X.SetSubVectorComplement(ess_tdof_list, 0.0); }
+         A.Reset(cached_A.get(), false);
+      }
+      else
+      {
+         // With nested iteration, the interpolated interior values are kept
+         // as the initial guess
+         a.FormLinearSystem(ess_tdof_list, x, b, A, X, B, nested);
+         if (use_cache)
+         {
+            Checkpoint entry;
+            entry.Add("A", a.SpMat());
+            entry.Add("A_e", a.SpMatElim());
+            entry.Add("ess_tdofs", ess_tdof_list);
+            cache.Store(level_key, entry);
+         }
+      }
+      bench.Record("form linear system", i, ndofs);
 
       cout << "Size of linear system: " << A->Height() << endl;
 
-      // 11. Solve the linear system A X = B.
-      if (!pa)
+      // The interpolated guess must start closer to the solution than the
+      // boundary values alone, the start without nested iteration
+      if (nested && i > 0 && A->Height() == fespace.GetTrueVSize())
+      {
+         Vector X_zero(X), r(B.Size());
+         X_zero.SetSubVectorComplement(ess_tdof_list, 0.0);
+         A->Mult(X, r);
+         r -= B;
+         const real_t r_nested = r.Norml2();
+         A->Mult(X_zero, r);
+         r -= B;
+         const real_t r_zero = r.Norml2();
+         out << "Initial residual: " << r_nested << " (zero start: " << r_zero
+             << ")" << endl;
+         if (r_nested >= r_zero)
+         {
+            MFEM_WARNING("nested iteration did not reduce the initial "
+                         "residual");
+         }
+      }
+
+      // 11. Solve the linear system A X = B. The PCG(...) and GMRES(...)
+      //     tolerances are squared, hence the square roots below.
+      auto krylov_solve = [&](IterativeSolver &solver, Solver *M,
+                              int print_level, int max_iter, real_t abs_tol)
+      {
+         solver.SetPrintLevel(print_level);
+         solver.SetMaxIter(max_iter);
+         solver.SetRelTol(rel_tol);
+         solver.SetAbsTol(abs_tol);
+         if (M) { solver.SetPreconditioner(*M); }
+         solver.SetOperator(*A);
+         bench.Start();
+         {
+            TraceScope trace(solver_name.c_str(), "solver");
+            solver.Mult(B, X);
+            trace.Arg(solver);
+         }
+         bench.Record("solve", i, ndofs, solver.GetNumIterations());
+         total_iterations += solver.GetNumIterations();
+         total_work += real_t(solver.GetNumIterations()) * ndofs;
+      };
+      if (mg)
+      {
+         if (bx*bx + by*by == 0.0)
+         {
+            CGSolver pcg;
+            krylov_solve(pcg, mg.get(), 1, 400, 0.0);
+         }
+         else
+         {
+            GMRESSolver gmres;
+            gmres.SetKDim(50);
+            krylov_solve(gmres, mg.get(), 1, 400, 1e-12);
+         }
+      }
+      else if (reordered)
+      {
+         const SparseMatrix &Amat = *A.As<SparseMatrix>();
+         Array<int> perm;
+         bench.Start();
+         ComputeDofOrdering(reorder, Amat, fespace, beta, perm);
+         bench.Record("reorder", i, ndofs);
+         const ReorderedSolveStats stats =
+            SolveReordered(Amat, B, X, perm, conv_prec, ilu_level, rel_tol, 0);
+         bench.Record("preconditioner setup", i, ndofs, stats.setup_time, -1);
+         bench.Record("solve", i, ndofs, stats.solve_time, stats.iterations);
+         total_iterations += stats.iterations;
+         total_work += real_t(stats.iterations) * ndofs;
+         out << "GMRES iterations: " << stats.iterations << ", SpMV: "
+             << stats.spmv_bandwidth << " GB/s, matrix bandwidth: "
+             << stats.matrix_bandwidth << endl;
+      }
+      else if (mixed_precision)
+      {
+         // krylov_solve makes the float copy of A in SetOperator
+         MixedPrecisionCG mpcg;
+         krylov_solve(mpcg, nullptr, 0, 2000, 0.0);
+         out << "Refinement steps: " << mpcg.GetNumRefinements()
+             << ", float copy: " << mpcg.MemoryBytes() / 1e6 << " MB" << endl;
+      }
+      else if (!pa)
       {
 #ifndef MFEM_USE_SUITESPARSE
          // Use a simple symmetric Gauss-Seidel preconditioner with PCG.
+         bench.Start();
          GSSmoother M((SparseMatrix&)(*A));
+         bench.Record("preconditioner setup", i, ndofs);
          if (bx*bx + by*by == 0.0)
          {
-            PCG(*A, M, B, X, 0, 2000, 1e-12, 0.0);
+            CGSolver pcg;
+            krylov_solve(pcg, &M, 0, 2000, 0.0);
          }
          else
          {
-            GMRES(*A, M, B, X, 0, 3000);
+            GMRESSolver gmres;
+            gmres.SetKDim(50);
+            krylov_solve(gmres, &M, 0, 3000, 1e-12);
          }
 #else
          // If MFEM was compiled with SuiteSparse, use UMFPACK to solve the system.
+         bench.Start();
          UMFPackSolver umf_solver;
          umf_solver.Control[UMFPACK_ORDERING] = UMFPACK_ORDERING_METIS;
          umf_solver.SetOperator(*A);
+         bench.Record("preconditioner setup", i, ndofs);
+         bench.Start();
          umf_solver.Mult(B, X);
+         bench.Record("solve", i, ndofs);
 #endif
       }
       else
@@ -313,29 +1402,49 @@ int main(int argc, char *argv[])
          {
             if (algebraic_ceed)
             {
+               bench.Start();
                ceed::AlgebraicSolver M(a, ess_tdof_list);
-               PCG(*A, M, B, X, 1, 400, 1e-12, 0.0);
+               bench.Record("preconditioner setup", i, ndofs);
+               CGSolver pcg;
+               krylov_solve(pcg, &M, 1, 400, 0.0);
             }
             else
             {
+               bench.Start();
                OperatorJacobiSmoother M(a, ess_tdof_list);
-               PCG(*A, M, B, X, 1, 400, 1e-12, 0.0);
+               bench.Record("preconditioner setup", i, ndofs);
+               CGSolver pcg;
+               krylov_solve(pcg, &M, 1, 400, 0.0);
             }
          }
          else
          {
-            CG(*A, B, X, 1, 400, 1e-12, 0.0);
+            CGSolver cg;
+            krylov_solve(cg, nullptr, 1, 400, 0.0);
          }
       }
 
       // 12. Recover the solution as a finite element grid function.
-      a.RecoverFEMSolution(X, b, x);
+      if (mg)
+      {
+         mg->RecoverFineFEMSolution(X, b, x);
+      }
+      else if (!cached)
+      {
+         a.RecoverFEMSolution(X, b, x);
+      }
 
       double err = x.ComputeL2Error(u);
 
       out << err << std::endl;
 
    }
+   if (ref_levels > 0)
+   {
+      out << "Total Krylov iterations: " << total_iterations
+          << ", work in finest-level iterations: "
+          << total_work / fespace.GetTrueVSize() << std::endl;
+   }
 
    // 14. Send the solution by socket to a GLVis server.
    if (visualization)
@@ -360,6 +1469,8 @@ int main(int argc, char *argv[])
    }
 
    // 15. Free the used memory.
+   mg.reset();
+   hierarchy.reset();
    if (delete_fec)
    {
       delete fec;
@@ -4,182 +4,1460 @@
 using namespace mfem;
 using namespace std;
 
+// M + dt*K applied through partially assembled forms. The diagonal is formed
+// from the assembled diagonals of M and K, so that Jacobi and Chebyshev
+// smoothers can be rebuilt cheaply when dt changes.
+class PAImplicitOperator : public Operator
+{
+   const BilinearForm &K, &M;
+   const Vector &diag_K, &diag_M;
+   const real_t dt;
+public:
+   PAImplicitOperator(const BilinearForm &K, const BilinearForm &M,
+                      const Vector &diag_K, const Vector &diag_M, real_t dt)
+      : Operator(M.Height()), K(K), M(M), diag_K(diag_K), diag_M(diag_M),
+        dt(dt) {}
+
+   void Mult(const Vector &x, Vector &y) const override
+   {
+      M.Mult(x, y);
+      K.AddMult(x, y, dt);
+   }
+
+   void AssembleDiagonal(Vector &diag) const override
+   {
+      add(diag_M, dt, diag_K, diag);
+   }
+};
+
 
 class ParabolicEquation : public TimeDependentOperator
 {
    // member variables
+public:
+   // Preconditioner for M + dt*K in partial assembly mode
+   enum PAPreconditioner { JACOBI, CHEBYSHEV };
+   // Application of M^{-1} in Mult, used by explicit ODE solvers
+   enum MassSolver { MASS_CG, MASS_LUMPED, MASS_JACOBI_PCG, MASS_CHOLESKY,
+                     MASS_BLOCK_DIAGONAL, NUM_MASS_SOLVERS
+                   };
 private:
 protected:
    BilinearForm &K, &M;
-   std::unique_ptr<SparseMatrix> mat;
+   const bool pa; // K and M are applied matrix-free
+   bool mixed = false; // float CG with refinement for the assembled solves
+   PAPreconditioner pa_prec_type = JACOBI;
+   MassSolver mass_type = MASS_JACOBI_PCG;
+   SparseMatrixSum op_sum; // M + dt*K on a fixed, merged sparsity pattern
+   std::unique_ptr<Operator> implicit_op; // M + dt*K, partial assembly
+   Array<int> ess_tdof_list; // empty, pure Neumann problem
+   mutable Vector diag;
+   mutable Vector diag_K, diag_M; // assembled diagonals, partial assembly
    LinearForm &load;
-   mutable std::unique_ptr<Solver> solver;
+   Coefficient *load_cf = nullptr; // set to the time of each load assembly
+   const SeparableLoad *sep_load = nullptr;
+   mutable std::unique_ptr<Solver> mass_solver;
+   mutable std::unique_ptr<Solver> mass_prec;
+   std::unique_ptr<IterativeSolver> implicit_solver;
+   std::unique_ptr<Solver> implicit_prec;
+   mutable WarmStart mass_guess; // initial guesses of the solves with M
+   WarmStart implicit_guess; // and with M + dt*K
    mutable Vector y_tmp;
    bool isOperatorTimeDependent;
    real_t prev_dt = mfem::infinity();
+   mutable int num_iterations = 0; // Krylov iterations of all solves
+   // optional multi-threaded reassembly of K, M and load
+   ThreadedAssembler *K_asm = nullptr, *M_asm = nullptr, *load_asm = nullptr;
+   BatchedDomainLF *batched_load = nullptr; // optional mesh-wide load
 public:
    // member functions
 private:
+   // Reassemble K and M in place. BilinearForm::Assemble adds into an
+   // existing matrix, so the values are reset first; the sparsity pattern is
+   // kept, and with it the merged pattern of op_sum.
+   void ReassembleOperators() const
+   {
+      BilinearForm *forms[] = {&K, &M};
+      ThreadedAssembler *assemblers[] = {K_asm, M_asm};
+      for (int i=0; i<2; i++)
+      {
+         if (assemblers[i])
+         {
+            assemblers[i]->Assemble(forms[i]->SpMat());
+            continue;
+         }
+         if (!pa) { forms[i]->SpMat() = 0.0; }
+         forms[i]->Assemble();
+         forms[i]->Finalize();
+      }
+      mass_solver.reset();
+      mass_guess.OperatorChanged();
+      diag_K.SetSize(0);
+      diag_M.SetSize(0);
+   }
+
+   // General integrators of load are reassembled; separable terms are added.
+   // Both are evaluated at time t.
+   void UpdateLoad(real_t t)
+   {
+      TraceScope trace("LinearForm::Assemble");
+      if (load_cf) { load_cf->SetTime(t); }
+      if (batched_load)
+      {
+         batched_load->Assemble(load);
+      }
+      else if (load_asm)
+      {
+         load_asm->Assemble(load);
+      }
+      else if (load.GetDLFI()->Size() || load.GetBLFI()->Size() ||
+               load.GetFLFI()->Size())
+      {
+         load.Assemble();
+      }
+      else
+      {
+         load = 0.0;
+      }
+      if (sep_load)
+      {
+         sep_load->AddTo(t, load);
+      }
+   }
+
+   // Set up the solver of M + dt*K for the step size dt.
+   void SetImplicitStep(real_t dt)
+   {
+      if (!implicit_solver)
+      {
+         if (mixed) { implicit_solver.reset(new MixedPrecisionCG); }
+         else { implicit_solver.reset(new CGSolver); }
+         implicit_solver->SetRelTol(1e-10);
+         implicit_solver->SetAbsTol(1e-10);
+         implicit_solver->SetMaxIter(1e06);
+         implicit_solver->SetPrintLevel(0);
+         if (!pa)
+         {
+            op_sum.AddTerm(M.SpMat());
+            op_sum.AddTerm(K.SpMat());
+         }
+         if (!pa && !mixed)
+         {
+            // Symmetric Gauss-Seidel works on the current matrix values, so it
+            // only needs to be re-attached when the values change.
+            implicit_prec.reset(new GSSmoother(0, 1));
+            implicit_solver->SetPreconditioner(*implicit_prec);
+         }
+      }
+      if (pa)
+      {
+         SetupPAImplicitOperator(dt);
+      }
+      else
+      {
+         // Only the values of M + dt*K are updated; the pattern is built
+         // once.
+         const real_t coeff[] = {1.0, dt};
+         implicit_solver->SetOperator(op_sum.Update(coeff));
+      }
+      implicit_guess.OperatorChanged();
+      prev_dt = dt;
+   }
+
+   // Build the action of M^{-1} once; it is kept until M changes.
+   void SetupMassSolver() const
+   {
+      mass_prec.reset();
+      switch (mass_type)
+      {
+         case MASS_LUMPED:
+         {
+            // Row sums of M, i.e. M applied to the constant function
+            Vector ones(Height()), lumped(Height());
+            ones = 1.0;
+            M.Mult(ones, lumped);
+            mass_solver.reset(new OperatorJacobiSmoother(lumped, ess_tdof_list));
+            break;
+         }
+         case MASS_CHOLESKY:
+         {
+            MFEM_VERIFY(!pa, "Cholesky mass solver requires full assembly");
+#ifdef MFEM_USE_SUITESPARSE
+            // Factorized once, then reused for every right-hand side
+            CHOLMODSolver *chol = new CHOLMODSolver;
+            chol->SetOperator(M.SpMat());
+            mass_solver.reset(chol);
+#else
+            MFEM_ABORT("Cholesky mass solver requires MFEM built with SuiteSparse");
+#endif
+            break;
+         }
+         case MASS_BLOCK_DIAGONAL:
+         {
+            // Exact for discontinuous spaces, where M is block diagonal
+            mass_solver.reset(new BlockDiagonalMassInverse(*M.FESpace()));
+            break;
+         }
+         default:
+         {
+            if (mixed)
+            {
+               // Its own float Gauss-Seidel replaces the Jacobi preconditioner
+               MixedPrecisionCG *mpcg = new MixedPrecisionCG;
+               mpcg->SetRelTol(1e-10);
+               mpcg->SetAbsTol(1e-10);
+               mpcg->SetMaxIter(1e06);
+               mpcg->SetPrintLevel(0);
+               mpcg->SetOperator(M.SpMat());
+               mass_solver.reset(mpcg);
+               break;
+            }
+            CGSolver * cg = new CGSolver;
+            cg->SetRelTol(1e-10);
+            cg->SetAbsTol(1e-10);
+            cg->SetMaxIter(1e06);
+            cg->SetPrintLevel(0);
+            if (mass_type == MASS_JACOBI_PCG)
+            {
+               diag.SetSize(Height());
+               if (pa) { M.AssembleDiagonal(diag); }
+               else { M.SpMat().GetDiag(diag); }
+               mass_prec.reset(new OperatorJacobiSmoother(diag, ess_tdof_list));
+               cg->SetPreconditioner(*mass_prec);
+            }
+            if (pa) { cg->SetOperator(M); }
+            else { cg->SetOperator(M.SpMat()); }
+            mass_solver.reset(cg);
+         }
+      }
+   }
+
+   // Rebuild M + dt*K and its preconditioner from the assembled diagonals.
+   void SetupPAImplicitOperator(const real_t dt)
+   {
+      if (diag_M.Size() == 0)
+      {
+         diag_K.SetSize(Height());
+         diag_M.SetSize(Height());
+         K.AssembleDiagonal(diag_K);
+         M.AssembleDiagonal(diag_M);
+      }
+      implicit_op.reset(new PAImplicitOperator(K, M, diag_K, diag_M, dt));
+      diag.SetSize(Height());
+      implicit_op->AssembleDiagonal(diag);
+      if (pa_prec_type == CHEBYSHEV)
+      {
+         implicit_prec.reset(new OperatorChebyshevSmoother(*implicit_op, diag,
+                                                           ess_tdof_list, 2));
+      }
+      else
+      {
+         implicit_prec.reset(new OperatorJacobiSmoother(diag, ess_tdof_list));
+      }
+      implicit_solver->SetPreconditioner(*implicit_prec);
+      implicit_solver->SetOperator(*implicit_op);
+   }
 protected:
 public:
    ParabolicEquation(BilinearForm &K, BilinearForm &M, LinearForm &load,
                      bool isOperatorTimeDependent=false)
-      :TimeDependentOperator(K.FESpace()->GetTrueVSize()), K(K), M(M), load(load),
+      :TimeDependentOperator(K.FESpace()->GetTrueVSize()), K(K), M(M),
+       pa(K.GetAssemblyLevel() == AssemblyLevel::PARTIAL), load(load),
        isOperatorTimeDependent(isOperatorTimeDependent)
-   { }
+   {
+      MFEM_VERIFY(pa == (M.GetAssemblyLevel() == AssemblyLevel::PARTIAL),
+                  "K and M must use the same assembly level");
+   }
+
+   /// Set the time of @a cf to the time of every load assembly. @a cf is the
+   /// coefficient of the integrators of the load, of the batched load and of
+   /// the threaded load assembler, so that they are evaluated at the stage
+   /// times of the ODE solver, like the separable terms.
+   void SetLoadCoefficient(Coefficient &cf)
+   {
+      load_cf = &cf;
+   }
+
+   /// Add the terms of @a sl to the load. Integrators of the LinearForm passed
+   /// to the constructor, if any, are still reassembled at every time.
+   void SetSeparableLoad(const SeparableLoad &sl)
+   {
+      sep_load = &sl;
+   }
+
+   /// Reassemble K, M and the load with these assemblers instead of the
+   /// forms; null keeps the serial path. The assemblers must hold the same
+   /// integrators as the forms passed to the constructor.
+   void SetThreadedAssembly(ThreadedAssembler *K_assembler,
+                            ThreadedAssembler *M_assembler,
+                            ThreadedAssembler *load_assembler)
+   {
+      MFEM_VERIFY(!pa || (!K_assembler && !M_assembler),
+                  "Threaded assembly of K and M requires full assembly");
+      K_asm = K_assembler;
+      M_asm = M_assembler;
+      load_asm = load_assembler;
+   }
+
+   /// Assemble the load with @a bl instead of the integrators of the
+   /// LinearForm passed to the constructor; null restores them.
+   void SetBatchedLoad(BatchedDomainLF *bl)
+   {
+      batched_load = bl;
+   }
+
+   /// Choose how M^{-1} is applied in Mult.
+   void SetMassSolver(MassSolver type)
+   {
+      mass_type = type;
+      mass_solver.reset();
+   }
+
+   /// Choose the initial guess of the mass and implicit solves from the
+   /// solutions of previous ones. By default, the solvers start from the
+   /// vector passed by the ODE solver.
+   void SetWarmStart(WarmStart::Type type)
+   {
+      mass_guess.SetType(type);
+      implicit_guess.SetType(type);
+   }
+
+   /// Solve with M and M + dt*K by float CG iterations with double-precision
+   /// iterative refinement (MixedPrecisionCG); requires full assembly. The
+   /// Cholesky and lumped mass solvers are not affected. Call before the
+   /// first implicit solve.
+   void SetMixedPrecision(bool use_mixed)
+   {
+      MFEM_VERIFY(!use_mixed || !pa, "Mixed precision requires full assembly");
+      MFEM_VERIFY(!implicit_solver, "the implicit solver is already set up");
+      mixed = use_mixed;
+      mass_solver.reset();
+   }
+
+   /// Bytes of the float copies kept by the mixed-precision solvers.
+   size_t MixedPrecisionBytes() const
+   {
+      size_t bytes = 0;
+      const Solver *solvers[] = {mass_solver.get(), implicit_solver.get()};
+      for (const Solver *s : solvers)
+      {
+         auto *mpcg = dynamic_cast<const MixedPrecisionCG*>(s);
+         if (mpcg) { bytes += mpcg->MemoryBytes(); }
+      }
+      return bytes;
+   }
+
+   /// Choose the preconditioner of M + dt*K used with partial assembly.
+   void SetPAPreconditioner(PAPreconditioner type)
+   {
+      pa_prec_type = type;
+      prev_dt = mfem::infinity();
+   }
+
+   /// Total Krylov iterations of the mass and implicit solves so far.
+   int GetNumIterations() const { return num_iterations; }
+
+   /// Add the state carried from one step to the next to @a ckpt, with names
+   /// starting with @a prefix: the step size of the implicit operator and the
+   /// warm-start data.
+   void SaveState(Checkpoint &ckpt, const std::string &prefix) const
+   {
+      ckpt.Add(prefix + "prev_dt", prev_dt);
+      mass_guess.Save(ckpt, prefix + "mass_guess/");
+      implicit_guess.Save(ckpt, prefix + "implicit_guess/");
+   }
+
+   /// Restore the state saved by SaveState(). The implicit operator is set
+   /// up for the saved step size first, so that the next step continues
+   /// exactly as without the restart. Call after the Set* methods.
+   void LoadState(const MappedCheckpoint &ckpt, const std::string &prefix)
+   {
+      const real_t dt = ckpt.GetScalar(prefix + "prev_dt");
+      if (dt < mfem::infinity() && !isOperatorTimeDependent)
+      {
+         SetImplicitStep(dt);
+      }
+      mass_guess.Load(ckpt, prefix + "mass_guess/");
+      implicit_guess.Load(ckpt, prefix + "implicit_guess/");
+   }
 
    void SetTime(real_t t) override
    {
+      TimeDependentOperator::SetTime(t);
       if (isOperatorTimeDependent)
       {
-         K.Assemble(); M.Assemble();
+         ReassembleOperators();
       }
-      load.Assemble();
+      UpdateLoad(t);
    }
 
 
    // Solve M^{-1}(Kx - load) = y
    void Mult(const Vector &x, Vector &y) const override
    {
-      if (!solver)
+      TraceScope trace("ParabolicEquation::Mult");
+      if (isOperatorTimeDependent)
       {
-         CGSolver * cg = new CGSolver;
-         cg->SetRelTol(1e-10);
-         cg->SetAbsTol(1e-10);
-         cg->SetMaxIter(1e06);
-         cg->SetPrintLevel(0);
-         solver.reset(cg);
+         ReassembleOperators();
       }
-      if (isOperatorTimeDependent)
+      if (!mass_solver)
       {
-         K.Assemble(); M.Assemble();
-         K.Finalize(); M.Finalize();
+         SetupMassSolver();
       }
-      load.Assemble();
+      // load is up to date: ODE solvers call SetTime before Mult
       y_tmp.SetSize(x.Size());
       y_tmp = load;
       K.AddMult(x, y_tmp, -1.0);
-      solver->SetOperator(M.SpMat());
       y = y_tmp;
-      solver->Mult(y_tmp, y);
+      auto *it = dynamic_cast<IterativeSolver*>(mass_solver.get());
+      if (it) { mass_guess.Guess(y_tmp, y, t); }
+      mass_solver->Mult(y_tmp, y);
+      if (it)
+      {
+         mass_guess.Add(M, y, t);
+         num_iterations += it->GetNumIterations();
+         trace.Arg(*it);
+      }
    }
 
    void ImplicitSolve(const real_t dt, const Vector &x, Vector &y) override
    {
-      if (!solver)
-      {
-         CGSolver * cg = new CGSolver;
-         cg->SetRelTol(1e-10);
-         cg->SetAbsTol(1e-10);
-         cg->SetMaxIter(1e06);
-         cg->SetPrintLevel(0);
-         solver.reset(cg);
-      }
+      TraceScope trace("ParabolicEquation::ImplicitSolve");
+      trace.Arg("dt", dt);
       if (isOperatorTimeDependent)
       {
-         K.Assemble(); M.Assemble();
-         K.Finalize(); M.Finalize();
+         ReassembleOperators();
       }
-      if (dt != prev_dt || isOperatorTimeDependent)
+      if (!implicit_solver || dt != prev_dt || isOperatorTimeDependent)
       {
-         mat.reset(Add(dt, K.SpMat(), 1.0, M.SpMat()));
-         solver->SetOperator(*mat);
+         SetImplicitStep(dt);
       }
 
       y_tmp = load;
       K.AddMult(x, y_tmp, -1.0);
 
-      solver->Mult(y_tmp, y);
+      const Operator &A = pa ? *implicit_op : op_sum.GetMatrix();
+      implicit_guess.Guess(y_tmp, y, t);
+      implicit_solver->Mult(y_tmp, y);
+      implicit_guess.Add(A, y, t);
+      num_iterations += implicit_solver->GetNumIterations();
+      trace.Arg(*implicit_solver);
+   }
+};
 
-      prev_dt = dt;
+// Order of accuracy of the solvers created by ODESolver::Select. Returns 0 for
+// solvers that carry a state between steps (multistep, generalized-alpha),
+// which cannot be restarted with a different step size.
+int ODESolverOrder(int type)
+{
+   switch (type)
+   {
+      case 1: case 21: return 1;
+      case 2: case 22: case 32: return 2;
+      case 3: case 23: case 33: return 3;
+      case 4: case 34: return 4;
+      case 6: return 6;
+      default: return 0;
+   }
+}
+
+// Step-doubling error control around a one-step ODESolver. Each attempt takes
+// one step of size dt and two of size dt/2 from the same state; their
+// difference estimates the local error of the half steps, which decides
+// whether the attempt is accepted and what the next dt is.
+class AdaptiveTimeStepper
+{
+   ODESolver &ode_solver;
+   const int order;
+   const real_t rtol, atol;
+   real_t dt_min = 0.0, dt_max = mfem::infinity();
+   const real_t safety = 0.9, max_growth = 5.0, max_shrink = 0.2;
+   Vector x_full, x_half;
+   int num_rejected = 0;
+
+   // Scaled max-norm of the local error estimate, <= 1 if acceptable
+   real_t ErrorNorm(const Vector &x) const
+   {
+      const real_t richardson = 1.0 / (std::pow(2.0, order) - 1.0);
+      const real_t *x0 = x.HostRead();
+      const real_t *xf = x_full.HostRead(), *xh = x_half.HostRead();
+      real_t err = 0.0;
+      for (int i=0; i<x.Size(); i++)
+      {
+         const real_t scale = atol + rtol*max(abs(x0[i]), abs(xh[i]));
+         err = max(err, richardson*abs(xh[i] - xf[i]) / scale);
+      }
+      return err;
+   }
+
+public:
+   AdaptiveTimeStepper(ODESolver &ode_solver, int order, real_t rtol,
+                       real_t atol)
+      : ode_solver(ode_solver), order(order), rtol(rtol), atol(atol)
+   {
+      MFEM_VERIFY(order > 0,
+                  "Adaptive stepping requires a one-step ODE solver");
+   }
+
+   void SetStepLimits(real_t min_dt, real_t max_dt)
+   {
+      dt_min = min_dt;
+      dt_max = max_dt;
    }
+
+   /// Advance (x, t) by one accepted step, not past @a t_final. On input, @a dt
+   /// is the step to try; on output, the proposed size of the next step.
+   void Step(Vector &x, real_t &t, real_t &dt, real_t t_final)
+   {
+      while (true)
+      {
+         dt = min(max(dt, dt_min), dt_max);
+         const real_t dt_try = min(dt, t_final - t);
+         real_t t_full = t, dt_full = dt_try;
+         x_full = x;
+         ode_solver.Step(x_full, t_full, dt_full);
+         real_t t_half = t, dt_half = dt_try/2;
+         x_half = x;
+         ode_solver.Step(x_half, t_half, dt_half);
+         dt_half = dt_try/2;
+         ode_solver.Step(x_half, t_half, dt_half);
+
+         const real_t err = ErrorNorm(x);
+         const real_t factor = err > 0.0 ?
+                               safety*std::pow(err, -1.0/(order + 1)) : max_growth;
+         if (err <= 1.0 || dt_try <= dt_min)
+         {
+            x = x_half;
+            t += dt_try;
+            dt = dt_try*min(max_growth, max(max_shrink, factor));
+            return;
+         }
+         num_rejected++;
+         dt = dt_try*max(max_shrink, factor);
+      }
+   }
+
+   int GetNumRejected() const { return num_rejected; }
+};
+
+// Parareal iteration over equal time slices of [t0, t1]. A cheap coarse
+// propagator G (large implicit steps) is swept over the slices in order, and
+// the fine propagator F (the ODE solver of the serial run) is applied to all
+// slices concurrently:
+//    U_{n+1}^{k+1} = G(U_n^{k+1}) + F(U_n^k) - G(U_n^k).
+// After k iterations the first k slices are exactly those of serial fine
+// stepping, so at most num_slices iterations are needed; the iteration stops
+// earlier once the largest change of the slice values is below the tolerance.
+// Each slice has its own ParabolicEquation, load and ODESolver; they share
+// only the assembled K and M, which are read-only with full assembly.
+class PararealSolver
+{
+public:
+   /// Creates a ParabolicEquation on @a load, a LinearForm owned by the
+   /// caller of the factory.
+   typedef std::function<ParabolicEquation*(LinearForm &load)> EquationFactory;
+
+private:
+   struct Propagator
+   {
+      std::unique_ptr<LinearForm> load;
+      std::unique_ptr<ParabolicEquation> equation;
+      std::unique_ptr<ODESolver> solver;
+      real_t dt; // largest step, <= 0 for one step per slice
+   };
+   const int num_slices, num_threads;
+   Propagator coarse;
+   std::vector<Propagator> fine;
+   real_t tol = 1e-8;
+   int num_iterations = 0;
+   real_t coarse_time = 0.0, fine_time = 0.0;
+   std::vector<Vector> U, G, F; // slice values, coarse and fine propagations
+   Vector G_new, U_new;
+
+   static void MakePropagator(Propagator &p, FiniteElementSpace &fes,
+                              const EquationFactory &make_equation,
+                              int type, real_t dt)
+   {
+      p.load.reset(new LinearForm(&fes));
+      p.equation.reset(make_equation(*p.load));
+      p.solver = ODESolver::Select(type);
+      p.dt = dt;
+   }
+
+   // Advance x from t0 to t1 in equal steps of at most p.dt. The solver is
+   // initialized again, so that multistep solvers do not reuse the stages
+   // of another slice.
+   static void Propagate(Propagator &p, Vector &x, real_t t0, real_t t1)
+   {
+      const int steps = p.dt > 0.0 ?
+                        max(1, int(std::ceil((t1 - t0)/p.dt - 1e-8))) : 1;
+      const real_t h = (t1 - t0)/steps;
+      p.equation->SetTime(t0);
+      p.solver->Init(*p.equation);
+      for (int i=0; i<steps; i++)
+      {
+         real_t t = t0 + i*h, dt = h;
+         p.solver->Step(x, t, dt);
+      }
+   }
+
+   real_t SliceTime(int n, real_t t0, real_t t1) const
+   {
+      return n == num_slices ? t1 : t0 + n*(t1 - t0)/num_slices;
+   }
+
+public:
+   PararealSolver(FiniteElementSpace &fes, const EquationFactory &make_equation,
+                  int num_slices, int num_threads, int fine_type,
+                  real_t fine_dt, int coarse_type, real_t coarse_dt)
+      : num_slices(num_slices), num_threads(num_threads), fine(num_slices)
+   {
+      MFEM_VERIFY(num_slices > 0, "Parareal needs at least one slice");
+      MakePropagator(coarse, fes, make_equation, coarse_type, coarse_dt);
+      for (Propagator &p : fine)
+      {
+         MakePropagator(p, fes, make_equation, fine_type, fine_dt);
+      }
+   }
+
+   /// Stop when the largest change of a slice value, relative to its max
+   /// norm, is below @a rel_tol.
+   void SetTolerance(real_t rel_tol) { tol = rel_tol; }
+
+   /// Advance @a x from @a t0 to @a t1 with the Parareal iteration.
+   void Solve(Vector &x, real_t t0, real_t t1)
+   {
+      StopWatch sw;
+      U.assign(num_slices + 1, x);
+      G.assign(num_slices, x);
+      F.assign(num_slices, x);
+      num_iterations = 0;
+
+      sw.Start();
+      for (int n=0; n<num_slices; n++)
+      {
+         G[n] = U[n];
+         Propagate(coarse, G[n], SliceTime(n, t0, t1), SliceTime(n+1, t0, t1));
+         U[n+1] = G[n];
+      }
+      sw.Stop();
+      coarse_time += sw.RealTime();
+
+      for (int k=0; k<num_slices; k++)
+      {
+         TraceScope trace("Parareal::Iteration");
+         trace.Arg("k", k);
+         // Slices before k have converged
+         sw.Clear();
+         sw.Start();
+         ParallelFor(num_slices - k, num_threads, [&](int i)
+         {
+            const int n = k + i;
+            TraceScope fine_trace("Parareal::Fine");
+            fine_trace.Arg("slice", n);
+            F[n] = U[n];
+            Propagate(fine[n], F[n], SliceTime(n, t0, t1),
+                      SliceTime(n+1, t0, t1));
+         });
+         sw.Stop();
+         fine_time += sw.RealTime();
+
+         sw.Clear();
+         sw.Start();
+         real_t change = 0.0;
+         for (int n=k; n<num_slices; n++)
+         {
+            // U_k did not change in this iteration, and neither did G(U_k)
+            G_new = n > k ? U[n] : G[n];
+            if (n > k)
+            {
+               Propagate(coarse, G_new, SliceTime(n, t0, t1),
+                         SliceTime(n+1, t0, t1));
+            }
+            add(G_new, -1.0, G[n], U_new);
+            U_new += F[n];
+            U[n+1] -= U_new;
+            change = max(change, U[n+1].Normlinf() /
+                         max(U_new.Normlinf(), real_t(1e-300)));
+            U[n+1].Swap(U_new);
+            G[n].Swap(G_new);
+         }
+         sw.Stop();
+         coarse_time += sw.RealTime();
+         num_iterations++;
+         trace.Arg("change", change);
+         if (change <= tol) { break; }
+      }
+      x = U[num_slices];
+   }
+
+   /// Advance @a x from @a t0 to @a t1 with the fine propagators, one slice
+   /// after another on the calling thread: the solution Parareal converges
+   /// to, and the serial reference for its speed-up.
+   void SolveSerial(Vector &x, real_t t0, real_t t1)
+   {
+      for (int n=0; n<num_slices; n++)
+      {
+         Propagate(fine[n], x, SliceTime(n, t0, t1), SliceTime(n+1, t0, t1));
+      }
+   }
+
+   /// Number of Parareal iterations of the last Solve().
+   int GetNumIterations() const { return num_iterations; }
+
+   /// Wall time of all Solve() calls in the coarse sweeps and in the
+   /// concurrent fine propagations.
+   real_t GetCoarseTime() const { return coarse_time; }
+   real_t GetFineTime() const { return fine_time; }
 };
 
 int main(int argc, char *argv[])
 {
    int order = 1;
    int ref_levels = 1;
+   bool dg = false;
+   real_t dg_kappa = -1.0;
    int ode_solver_type = 21;
    bool vis = false;
+   bool pa = false;
+   int pa_prec = ParabolicEquation::JACOBI;
+   int mass_solver = -1;
+   int mass_benchmark = 0;
+   int warm_start = WarmStart::NONE;
+   int num_threads = 1;
+   int assembly_benchmark = 0;
+   bool separable_load = false;
+   bool batched_load = false;
+   int quadrature_benchmark = 0;
+   bool vis_async = false;
+   real_t vis_fps = 0.0;
+   real_t vis_dt = 0.0;
+   bool adaptive = false;
+   real_t rtol = 1e-4;
+   real_t atol = 1e-6;
+   real_t dt_min = 0.0;
+   real_t dt_max = 0.1;
    real_t dt = 0.00001;
+   real_t t_final = 1.0;
+   const char *benchmark_file = "";
+   const char *trace_file = "";
+   const char *series_prefix = "";
+   real_t series_dt = 0.0;
+   bool series_compress = false;
+   const char *paraview_name = "";
+   const char *checkpoint_file = "";
+   int checkpoint_interval = 100;
+   const char *restart_file = "";
+   const char *cache_dir = "";
+   int parareal_slices = 0;
+   int parareal_coarse_solver = 21;
+   real_t parareal_coarse_dt = 0.0;
+   real_t parareal_tol = 1e-8;
+   bool mixed_precision = false;
 
    OptionsParser args(argc, argv);
    args.AddOption(&order, "-o", "--order",
                   "Polynomial order for the finite element space.");
    args.AddOption(&ref_levels, "-r", "--refine",
                   "Number of uniform refinements.");
+   args.AddOption(&dg, "-dg", "--discontinuous", "-no-dg",
+                  "--no-discontinuous",
+                  "Use a discontinuous (L2) space with interior penalty instead "
+                  "of H1.");
+   args.AddOption(&dg_kappa, "-dgk", "--dg-penalty",
+                  "Interior penalty parameter, < 0 for (order+1)^2.");
    args.AddOption(&dt, "-dt", "--time-step",
                   "Time step size.");
+   args.AddOption(&t_final, "-tf", "--t-final",
+                  "Final time.");
    args.AddOption(&vis, "-v", "--visualize", "--no-vis", "--no-visualization",
                   "-v 1 to visualize the solution.");
    args.AddOption(&ode_solver_type, "-s", "--ode-solver",
                   ODESolver::Types.c_str());
+   args.AddOption(&pa, "-pa", "--partial-assembly", "-no-pa",
+                  "--no-partial-assembly", "Enable Partial Assembly.");
+   args.AddOption(&pa_prec, "-pc", "--pa-preconditioner",
+                  "Preconditioner for M + dt*K with partial assembly: "
+                  "0 - Jacobi, 1 - Chebyshev.");
+   args.AddOption(&mass_solver, "-ms", "--mass-solver",
+                  "Mass inverse for explicit solvers: 0 - CG, 1 - row-sum lumping, "
+                  "2 - Jacobi PCG, 3 - Cholesky (SuiteSparse), 4 - element-wise "
+                  "inverse (DG only). Default: 4 with -dg, 2 otherwise.");
+   args.AddOption(&warm_start, "-ws", "--warm-start",
+                  "Initial guess of the solves: 0 - from the ODE solver, "
+                  "1 - previous solution, 2 - linear extrapolation, "
+                  "3 - projection onto previous solutions.");
+   args.AddOption(&num_threads, "-nt", "--num-threads",
+                  "Number of threads for reassembling the operators and load, "
+                  "and for the Parareal slices.");
+   args.AddOption(&assembly_benchmark, "-ab", "--assembly-benchmark",
+                  "Time this many reassemblies for 1, 2, 4, ... threads and exit.");
+   args.AddOption(&mass_benchmark, "-mb", "--mass-benchmark",
+                  "Time this many RHS evaluations with each mass solver and exit.");
+   args.AddOption(&separable_load, "-sl", "--separable-load", "-no-sl",
+                  "--no-separable-load",
+                  "Assemble the load as g(t) f(x) once instead of at every time.");
+   args.AddOption(&batched_load, "-bl", "--batched-load", "-no-bl",
+                  "--no-batched-load",
+                  "Evaluate the load at all quadrature points of the mesh in one "
+                  "call, with the geometry computed once.");
+   args.AddOption(&quadrature_benchmark, "-qb", "--quadrature-benchmark",
+                  "Time this many load assemblies with each coefficient "
+                  "evaluation and exit.");
+   args.AddOption(&vis_async, "-va", "--vis-async", "-no-va", "--no-vis-async",
+                  "Send GLVis frames from a background thread.");
+   args.AddOption(&vis_fps, "-vfps", "--vis-max-fps",
+                  "Maximum GLVis frames per second, 0 for no limit.");
+   args.AddOption(&vis_dt, "-vdt", "--vis-time-step",
+                  "Minimum simulated time between GLVis frames.");
+   args.AddOption(&adaptive, "-adapt", "--adaptive", "-no-adapt",
+                  "--no-adaptive",
+                  "Adapt the time step with step-doubling error control.");
+   args.AddOption(&rtol, "-rtol", "--relative-tolerance",
+                  "Relative local error tolerance for adaptive stepping.");
+   args.AddOption(&atol, "-atol", "--absolute-tolerance",
+                  "Absolute local error tolerance for adaptive stepping.");
+   args.AddOption(&dt_min, "-dtmin", "--min-time-step",
+                  "Minimum time step for adaptive stepping.");
+   args.AddOption(&dt_max, "-dtmax", "--max-time-step",
+                  "Maximum time step for adaptive stepping.");
+   args.AddOption(&benchmark_file, "-bf", "--benchmark-file",
+                  "Append the time of each phase to this CSV file.");
+   args.AddOption(&trace_file, "-tr", "--trace",
+                  "Write a Chrome trace of the solver phases to this JSON file.");
+   args.AddOption(&series_prefix, "-ts", "--time-series",
+                  "Append snapshots of u to <prefix>.bin with index <prefix>.idx.");
+   args.AddOption(&series_dt, "-tsdt", "--time-series-dt",
+                  "Minimum simulated time between snapshots, 0 for every step.");
+   args.AddOption(&series_compress, "-tsz", "--time-series-compress", "-no-tsz",
+                  "--no-time-series-compress",
+                  "Compress the snapshots with zlib.");
+   args.AddOption(&paraview_name, "-pv", "--paraview",
+                  "After the run, export the time series to this ParaView "
+                  "collection.");
+   args.AddOption(&checkpoint_file, "-ck", "--checkpoint",
+                  "Save the mesh, solution and solver state to this file.");
+   args.AddOption(&checkpoint_interval, "-cki", "--checkpoint-interval",
+                  "Number of time steps between checkpoints.");
+   args.AddOption(&restart_file, "-restart", "--restart",
+                  "Resume from this checkpoint; the other options must match "
+                  "the original run.");
+   args.AddOption(&cache_dir, "-oc", "--operator-cache",
+                  "Load K and M from this directory, or store them there "
+                  "after assembly.");
+   args.AddOption(&mixed_precision, "-mp", "--mixed-precision", "-no-mp",
+                  "--no-mixed-precision",
+                  "Solve with M and M + dt*K by float CG iterations with "
+                  "double-precision iterative refinement.");
+   args.AddOption(&parareal_slices, "-pr", "--parareal",
+                  "Solve with Parareal on this many time slices, compare with "
+                  "serial stepping and exit; 0 to step serially.");
+   args.AddOption(&parareal_coarse_solver, "-prs", "--parareal-coarse-solver",
+                  "ODE solver of the Parareal coarse propagator.");
+   args.AddOption(&parareal_coarse_dt, "-prdt", "--parareal-coarse-dt",
+                  "Time step of the Parareal coarse propagator, 0 for one "
+                  "step per slice.");
+   args.AddOption(&parareal_tol, "-prtol", "--parareal-tolerance",
+                  "Relative change of the slice values that ends Parareal.");
    args.ParseCheck();
+   // Parareal slices evaluate the load at their own times in parallel, which
+   // the separable load does without sharing the time of load_cf
+   if (parareal_slices > 0) { separable_load = true; }
+   if (mass_solver < 0)
+   {
+      mass_solver = dg ? ParabolicEquation::MASS_BLOCK_DIAGONAL
+                    : ParabolicEquation::MASS_JACOBI_PCG;
+   }
+   MFEM_VERIFY(!dg || !pa, "-dg requires full assembly");
+   MFEM_VERIFY(checkpoint_interval > 0, "-cki must be positive");
+   // The adaptive stepper alternates dt and dt/2 and rejects steps, so the
+   // stored solutions would come from other operators and discarded steps
+   MFEM_VERIFY(!adaptive || warm_start == WarmStart::NONE,
+               "-ws is not supported with -adapt");
+   if (dg_kappa < 0.0) { dg_kappa = (order + 1)*(order + 1); }
+   Tracer::Get().Enable(trace_file);
 
+   BenchmarkLog bench(benchmark_file, dg ? "heat-dg" : "heat", order,
+                      pa ? "partial" : "legacy",
+                      "ode" + std::to_string(ode_solver_type) +
+                      (mixed_precision ? "-mp" : ""));
 
-   Mesh mesh = Mesh::MakeCartesian2D(2, 2, Element::Type::QUADRILATERAL);
-   for (int i=0; i<ref_levels; i++)
+   unique_ptr<MappedCheckpoint> restart;
+   if (*restart_file) { restart.reset(new MappedCheckpoint(restart_file)); }
+
+   bench.Start();
+   Mesh mesh;
+   if (restart)
+   {
+      istringstream mesh_text(restart->GetString("mesh"));
+      mesh = Mesh(mesh_text, 1, 1);
+   }
+   else
    {
-      mesh.UniformRefinement();
+      mesh = Mesh::MakeCartesian2D(2, 2, Element::Type::QUADRILATERAL);
+      for (int i=0; i<ref_levels; i++)
+      {
+         mesh.UniformRefinement();
+      }
    }
+   bench.Record("mesh refine", ref_levels, 0);
 
    const int dim = mesh.SpaceDimension();
 
-   real_t t = 0.0;
-   const real_t t_final = 1.0;
+   real_t t = restart ? restart->GetScalar("t") : 0.0;
 
-   H1_FECollection fec(order, dim);
-   FiniteElementSpace fes(&mesh, &fec);
+   bench.Start();
+   unique_ptr<FiniteElementCollection> fec;
+   if (dg) { fec.reset(new L2_FECollection(order, dim)); }
+   else { fec.reset(new H1_FECollection(order, dim)); }
+   FiniteElementSpace fes(&mesh, fec.get());
+   const long long ndofs = fes.GetTrueVSize();
+   bench.Record("fespace update", ref_levels, ndofs);
 
    constexpr real_t pi = M_PI;
-   FunctionCoefficient load_cf([pi, &t](const Vector &x)
+   // Batched coefficients: the integrators evaluate all quadrature points of
+   // an element (or of the mesh, with -bl) in one call. The load is evaluated
+   // at its coefficient time, which ParabolicEquation sets to the stage times.
+   auto load_cf = MakeBatchedCoefficient([pi](real_t x, real_t y, real_t,
+                                              real_t t)
    {
-      return (2*sin(5*t)*std::pow(pi,2.0) + 5*cos(5*t))*cos(pi*x[0])*cos(pi*x[1]);
+      return (2*sin(5*t)*std::pow(pi,2.0) + 5*cos(5*t))*cos(pi*x)*cos(pi*y);
    });
-   FunctionCoefficient u0_cf([pi, &t](const Vector &x)
+   auto u0_cf = MakeBatchedCoefficient([pi, &t](real_t x, real_t y, real_t)
    {
-      return sin(5*t)*cos(pi*x[0])*cos(pi*x[1]);
+      return sin(5*t)*cos(pi*x)*cos(pi*y);
    });
 
 
    GridFunction u(&fes);
    u.ProjectCoefficient(u0_cf);
+   if (restart)
+   {
+      Vector u_saved;
+      restart->GetVector("u", u_saved);
+      MFEM_VERIFY(u_saved.Size() == u.Size(),
+                  "the checkpoint does not match the space");
+      u = u_saved;
+      dt = restart->GetScalar("dt");
+   }
 
+   // The load is g(t) f(x) with g(t) = 2 pi^2 sin(5t) + 5 cos(5t) and
+   // f(x) = cos(pi x) cos(pi y).
+   auto load_space_cf = MakeBatchedCoefficient([pi](real_t x, real_t y, real_t)
+   {
+      return cos(pi*x)*cos(pi*y);
+   });
+   bench.Start();
+   SeparableLoad load_sep(fes);
    LinearForm load(&fes);
-   load.AddDomainIntegrator(new DomainLFIntegrator(load_cf));
+   if (separable_load)
+   {
+      load_sep.AddTerm([pi](real_t t)
+      {
+         return 2*sin(5*t)*std::pow(pi,2.0) + 5*cos(5*t);
+      }, load_space_cf);
+   }
+   else
+   {
+      load.AddDomainIntegrator(new BatchedDomainLFIntegrator(load_cf));
+   }
+   load_cf.SetTime(t);
    load.Assemble();
+   unique_ptr<BatchedDomainLF> load_batched;
+   if (batched_load && !separable_load)
+   {
+      load_batched.reset(new BatchedDomainLF(fes, load_cf));
+   }
+
+   // K and M depend on the mesh, the space and the integrators. The mesh is
+   // the refined Cartesian one, unless it comes from a checkpoint.
+   OperatorCache cache(cache_dir);
+   const string cache_key = string("heat mesh=") +
+                            (restart ? OperatorCache::Hash(
+                                restart->GetString("mesh"))
+                             : "cartesian2d-2x2-quad refine=" +
+                             to_string(ref_levels)) +
+                            " fec=" + fec->Name() +
+                            (dg ? " integrators=diffusion,dg-diffusion(-1," +
+                             to_string(dg_kappa) + "),mass"
+                             : " integrators=diffusion,mass");
+   unique_ptr<MappedCheckpoint> cached;
+   if (*cache_dir && !pa) { cached = cache.Load(cache_key); }
 
-   BilinearForm diffusion(&fes);
+   CachedBilinearForm diffusion(&fes);
+   if (pa) { diffusion.SetAssemblyLevel(AssemblyLevel::PARTIAL); }
    diffusion.AddDomainIntegrator(new DiffusionIntegrator());
-   diffusion.Assemble();
-   diffusion.Finalize();
-   BilinearForm mass(&fes);
+   if (dg)
+   {
+      // Symmetric interior penalty; the boundary faces get no terms, which is
+      // the homogeneous Neumann condition of the H1 problem
+      diffusion.AddInteriorFaceIntegrator(new DGDiffusionIntegrator(-1.0,
+                                                                    dg_kappa));
+   }
+   CachedBilinearForm mass(&fes);
+   if (pa) { mass.SetAssemblyLevel(AssemblyLevel::PARTIAL); }
    mass.AddDomainIntegrator(new MassIntegrator());
-   mass.Assemble();
-   mass.Finalize();
+   if (cached)
+   {
+      diffusion.SetMatrix(cached->NewSparseMatrix("K"));
+      mass.SetMatrix(cached->NewSparseMatrix("M"));
+      bench.Record("operator cache load", ref_levels, ndofs);
+      out << "Loaded K and M from " << cache.FileName(cache_key) << endl;
+   }
+   else
+   {
+      diffusion.Assemble();
+      diffusion.Finalize();
+      mass.Assemble();
+      mass.Finalize();
+      bench.Record("assemble", ref_levels, ndofs);
+      if (*cache_dir && !pa)
+      {
+         Checkpoint entry;
+         entry.Add("K", diffusion.SpMat());
+         entry.Add("M", mass.SpMat());
+         cache.Store(cache_key, entry);
+      }
+   }
+
+   // Threaded reassembly into the patterns of the serial assembly above, with
+   // the same integrators
+   unique_ptr<ThreadedAssembler> diffusion_asm, mass_asm, load_asm;
+   auto make_assemblers = [&](int threads)
+   {
+      diffusion_asm.reset(new ThreadedAssembler(fes, threads));
+      diffusion_asm->AddDomainIntegrator([]() -> BilinearFormIntegrator*
+      {
+         return new DiffusionIntegrator();
+      });
+      mass_asm.reset(new ThreadedAssembler(fes, threads));
+      mass_asm->AddDomainIntegrator([]() -> BilinearFormIntegrator*
+      {
+         return new MassIntegrator();
+      });
+      load_asm.reset();
+      if (!separable_load)
+      {
+         load_asm.reset(new ThreadedAssembler(fes, threads));
+         load_asm->AddDomainIntegrator([&load_cf]() -> LinearFormIntegrator*
+         {
+            return new BatchedDomainLFIntegrator(load_cf);
+         });
+      }
+   };
+   if (quadrature_benchmark > 0)
+   {
+      MFEM_VERIFY(!separable_load, "-qb times the load integrators");
+      // The same load with a per-point std::function coefficient, the
+      // per-element batched integrator and the mesh-wide batched form
+      FunctionCoefficient load_fn([pi, &t](const Vector &x)
+      {
+         return (2*sin(5*t)*std::pow(pi,2.0) + 5*cos(5*t))*cos(pi*x[0])*cos(pi*x[1]);
+      });
+      LinearForm load_pointwise(&fes);
+      load_pointwise.AddDomainIntegrator(new DomainLFIntegrator(load_fn));
+      BatchedDomainLF load_mesh(fes, load_cf);
+      const real_t points = real_t(load_mesh.NumPoints()) * quadrature_benchmark;
+
+      Vector b(fes.GetVSize()), b_ref(fes.GetVSize());
+      const char *names[] = {"per point", "per element", "mesh-wide"};
+      std::function<void(Vector&)> assemble[] =
+      {
+         [&](Vector &v) { load_pointwise.Assemble(); v = load_pointwise; },
+         [&](Vector &v) { load.Assemble(); v = load; },
+         [&](Vector &v) { load_mesh.Assemble(v); }
+      };
+      out << "Quadrature points per assembly: " << load_mesh.NumPoints() << endl;
+      out << setw(14) << "coefficient" << setw(16) << "time [s]" << setw(16)
+          << "points/s" << setw(16) << "rel. diff" << endl;
+      for (int k=0; k<3; k++)
+      {
+         StopWatch sw;
+         sw.Start();
+         for (int r=0; r<quadrature_benchmark; r++)
+         {
+            t = r*dt;
+            load_cf.SetTime(t);
+            assemble[k](b);
+         }
+         sw.Stop();
+         if (k == 0) { b_ref = b; }
+         b -= b_ref;
+         out << setw(14) << names[k] << setw(16)
+             << sw.RealTime() / quadrature_benchmark << setw(16)
+             << points / sw.RealTime() << setw(16)
+             << b.Normlinf() / b_ref.Normlinf() << endl;
+      }
+      return 0;
+   }
+
+   if (num_threads > 1 || assembly_benchmark > 0)
+   {
+      MFEM_VERIFY(!pa, "Threaded assembly requires full assembly");
+      // The threaded assemblers have no face integrators
+      MFEM_VERIFY(!dg || assembly_benchmark == 0,
+                  "-ab does not support -dg");
+      make_assemblers(num_threads);
+   }
+
+   if (assembly_benchmark > 0)
+   {
+      // Serial reference, timed the way ParabolicEquation reassembles
+      StopWatch sw;
+      sw.Start();
+      for (int r=0; r<assembly_benchmark; r++)
+      {
+         for (BilinearForm *form : {&diffusion, &mass})
+         {
+            form->SpMat() = 0.0;
+            form->Assemble();
+            form->Finalize();
+         }
+         if (!separable_load) { load.Assemble(); }
+      }
+      sw.Stop();
+      const real_t serial_time = sw.RealTime() / assembly_benchmark;
+      const SparseMatrix K_ref(diffusion.SpMat()), M_ref(mass.SpMat());
+      const Vector load_ref(load);
+      auto max_diff = [](const real_t *a, const real_t *b, int n)
+      {
+         real_t diff = 0.0;
+         for (int i=0; i<n; i++) { diff = max(diff, abs(a[i] - b[i])); }
+         return diff;
+      };
+
+      out << setw(10) << "threads" << setw(16) << "time [s]" << setw(12)
+          << "speed-up" << setw(16) << "max diff" << endl;
+      out << setw(10) << "serial" << setw(16) << serial_time << setw(12) << 1.0
+          << setw(16) << 0.0 << endl;
+      std::vector<int> thread_counts;
+      for (int threads = 1; threads < num_threads; threads *= 2)
+      {
+         thread_counts.push_back(threads);
+      }
+      thread_counts.push_back(num_threads);
+      for (int threads : thread_counts)
+      {
+         make_assemblers(threads);
+         sw.Clear();
+         sw.Start();
+         for (int r=0; r<assembly_benchmark; r++)
+         {
+            diffusion_asm->Assemble(diffusion.SpMat());
+            mass_asm->Assemble(mass.SpMat());
+            if (load_asm) { load_asm->Assemble(load); }
+         }
+         sw.Stop();
+         const real_t time = sw.RealTime() / assembly_benchmark;
+         const real_t diff = max(
+         {
+            max_diff(diffusion.SpMat().HostReadData(), K_ref.HostReadData(),
+                     K_ref.NumNonZeroElems()),
+            max_diff(mass.SpMat().HostReadData(), M_ref.HostReadData(),
+                     M_ref.NumNonZeroElems()),
+            max_diff(load.HostRead(), load_ref.HostRead(), load.Size())
+         });
+         out << setw(10) << threads << setw(16) << time << setw(12)
+             << serial_time / time << setw(16) << diff << endl;
+      }
+      return 0;
+   }
 
    ParabolicEquation parabolic(diffusion, mass, load);
+   // The threaded assemblers have no face integrators, so with -dg only the
+   // load is threaded
+   parabolic.SetThreadedAssembly(dg ? nullptr : diffusion_asm.get(),
+                                 dg ? nullptr : mass_asm.get(),
+                                 load_asm.get());
+   if (separable_load) { parabolic.SetSeparableLoad(load_sep); }
+   else { parabolic.SetLoadCoefficient(load_cf); }
+   parabolic.SetBatchedLoad(load_batched.get());
+   parabolic.SetPAPreconditioner(
+      static_cast<ParabolicEquation::PAPreconditioner>(pa_prec));
    parabolic.SetTime(t);
 
+   if (mass_benchmark > 0)
+   {
+      const char *names[] = {"CG", "lumped", "Jacobi PCG", "Cholesky",
+                             "block diag"};
+      Vector y_ref(u.Size()), y(u.Size());
+      parabolic.SetMassSolver(ParabolicEquation::MASS_CG);
+      parabolic.Mult(u, y_ref);
+      out << setw(12) << "mass solver" << setw(16) << "setup [s]"
+          << setw(16) << "per RHS [s]" << setw(16) << "rel. diff" << endl;
+      for (int s = 0; s < ParabolicEquation::NUM_MASS_SOLVERS; s++)
+      {
+#ifndef MFEM_USE_SUITESPARSE
+         if (s == ParabolicEquation::MASS_CHOLESKY) { continue; }
+#endif
+         if (pa && s == ParabolicEquation::MASS_CHOLESKY) { continue; }
+         if (!dg && s == ParabolicEquation::MASS_BLOCK_DIAGONAL) { continue; }
+         StopWatch sw;
+         parabolic.SetMassSolver(static_cast<ParabolicEquation::MassSolver>(s));
+         sw.Start();
+         parabolic.Mult(u, y); // includes the one-time setup
+         sw.Stop();
+         const real_t first = sw.RealTime();
+         sw.Clear();
+         sw.Start();
+         for (int i=0; i<mass_benchmark; i++)
+         {
+            parabolic.Mult(u, y);
+         }
+         sw.Stop();
+         const real_t per_rhs = sw.RealTime() / mass_benchmark;
+         y -= y_ref;
+         out << setw(12) << names[s] << setw(16) << first - per_rhs
+             << setw(16) << per_rhs << setw(16) << y.Norml2() / y_ref.Norml2()
+             << endl;
+      }
+      return 0;
+   }
+   parabolic.SetMassSolver(
+      static_cast<ParabolicEquation::MassSolver>(mass_solver));
+   parabolic.SetWarmStart(static_cast<WarmStart::Type>(warm_start));
+   parabolic.SetMixedPrecision(mixed_precision);
+
+   if (parareal_slices > 0)
+   {
+      MFEM_VERIFY(!pa, "Parareal requires full assembly");
+      MFEM_VERIFY(!adaptive, "Parareal uses fixed time steps");
+      auto make_equation = [&](LinearForm &slice_load)
+      {
+         ParabolicEquation *eq = new ParabolicEquation(diffusion, mass,
+                                                       slice_load);
+         eq->SetSeparableLoad(load_sep);
+         eq->SetMassSolver(
+            static_cast<ParabolicEquation::MassSolver>(mass_solver));
+         eq->SetMixedPrecision(mixed_precision);
+         return eq;
+      };
+      PararealSolver parareal(fes, make_equation, parareal_slices, num_threads,
+                              ode_solver_type, dt, parareal_coarse_solver,
+                              parareal_coarse_dt);
+      parareal.SetTolerance(parareal_tol);
+
+      StopWatch sw;
+      Vector u_serial(u);
+      sw.Start();
+      parareal.SolveSerial(u_serial, t, t_final);
+      sw.Stop();
+      const real_t serial_time = sw.RealTime();
+      bench.Record("parareal serial", parareal_slices, ndofs, serial_time, -1);
+      sw.Clear();
+      sw.Start();
+      parareal.Solve(u, t, t_final);
+      sw.Stop();
+      bench.Record("parareal", parareal_slices, ndofs, sw.RealTime(),
+                   parareal.GetNumIterations());
+      u_serial -= u;
+      t = t_final;
+
+      out << "Parareal: " << parareal_slices << " slices on " << num_threads
+          << " threads" << endl;
+      out << "Serial fine stepping: " << serial_time << " s" << endl;
+      out << "Parareal iterations: " << parareal.GetNumIterations()
+          << ", wall time: " << sw.RealTime() << " s (coarse "
+          << parareal.GetCoarseTime() << " s, fine "
+          << parareal.GetFineTime() << " s), speed-up: "
+          << serial_time / sw.RealTime() << endl;
+      out << "Max difference to serial stepping: " << u_serial.Normlinf()
+          << endl;
+      out << "L2 error: " << u.ComputeL2Error(u0_cf) << std::endl;
+      return 0;
+   }
+
    unique_ptr<ODESolver> ode_solver = ODESolver::Select(ode_solver_type);
    ode_solver->Init(parabolic);
+   // Previous stages of multistep solvers, index 0 the newest
+   auto *ode_states = dynamic_cast<ODESolverWithStates*>(ode_solver.get());
+   int step = 0;
+   if (restart)
+   {
+      step = int(restart->GetScalar("step"));
+      parabolic.LoadState(*restart, "parabolic/");
+      if (ode_states)
+      {
+         ODEStateData &state = ode_states->GetState();
+         state.Reset();
+         Vector stage;
+         const int num_states = int(restart->GetScalar("ode/num_states"));
+         for (int i = num_states - 1; i >= 0; i--)
+         {
+            restart->GetVector("ode/state" + to_string(i), stage);
+            state.Append(stage);
+         }
+      }
+      out << "Restarted from " << restart_file << " at step " << step
+          << ", time " << t << endl;
+      restart.reset();
+   }
+
+   // Everything needed to continue the run bit for bit. The mesh is saved
+   // with full precision, and the restarted run builds its space on it.
+   ostringstream mesh_text;
+   mesh_text.precision(17);
+   mesh.Print(mesh_text);
+   const string mesh_string = mesh_text.str();
+   int num_checkpoints = 0;
+   real_t checkpoint_time = 0.0;
+   size_t checkpoint_bytes = 0;
+   auto write_checkpoint = [&]()
+   {
+      StopWatch sw;
+      sw.Start();
+      Checkpoint ckpt;
+      ckpt.Add("mesh", mesh_string);
+      ckpt.Add("u", u);
+      ckpt.Add("t", t);
+      ckpt.Add("dt", dt);
+      ckpt.Add("step", real_t(step));
+      parabolic.SaveState(ckpt, "parabolic/");
+      if (ode_states)
+      {
+         const ODEStateData &state = ode_states->GetState();
+         ckpt.Add("ode/num_states", real_t(state.Size()));
+         for (int i=0; i<state.Size(); i++)
+         {
+            ckpt.Add("ode/state" + to_string(i), state.Get(i));
+         }
+      }
+      checkpoint_bytes = ckpt.Write(checkpoint_file);
+      sw.Stop();
+      checkpoint_time += sw.RealTime();
+      num_checkpoints++;
+   };
 
    GLVis glvis("localhost", 19916, false);
-   glvis.Append(u, "u");
-   glvis.Update();
-   glvis.SetBound(0, -1.0, 1.0);
-   real_t visualization_dt = 0.1;
-   real_t last_visualization_time = 0.0;
+   if (vis)
+   {
+      glvis.Append(u, "u");
+      glvis.Update();
+      glvis.SetBound(0, -1.0, 1.0);
+      glvis.SetMaxRate(vis_fps, vis_dt);
+      if (vis_async) { glvis.StartAsync(); }
+   }
+   unique_ptr<AdaptiveTimeStepper> stepper;
+   if (adaptive)
+   {
+      stepper.reset(new AdaptiveTimeStepper(*ode_solver,
+                                            ODESolverOrder(ode_solver_type),
+                                            rtol, atol));
+      stepper->SetStepLimits(dt_min, dt_max);
+   }
+   unique_ptr<TimeSeriesWriter> series;
+   if (*series_prefix)
+   {
+      series.reset(new TimeSeriesWriter(series_prefix, u, series_compress));
+      series->SetInterval(series_dt);
+      series->Write(u, t);
+   }
+   StopWatch timer;
+   timer.Start();
+   int num_steps = 0;
+   real_t first_step = 0.0;
+   int first_its = 0;
    while (t < t_final)
    {
-      real_t dt_real = min(dt, t_final - t);
-      ode_solver->Step(u, t, dt_real);
-      out << "time = " << t << std::endl;
-      // if (t - last_visualization_time > visualization_dt)
-      // {
-         glvis.Update();
-      //    last_visualization_time += visualization_dt;
-      // }
+      const int step_its = parabolic.GetNumIterations();
+      if (num_steps == 0) { bench.Start(); }
+      {
+         TraceScope trace("ODESolver::Step");
+         trace.Arg("t", t);
+         if (stepper)
+         {
+            stepper->Step(u, t, dt, t_final);
+         }
+         else
+         {
+            real_t dt_real = min(dt, t_final - t);
+            ode_solver->Step(u, t, dt_real);
+         }
+      }
+      if (num_steps == 0)
+      {
+         // The first step includes the one-time solver setup
+         bench.Record("first ode step", ref_levels, ndofs,
+                      parabolic.GetNumIterations());
+         first_step = timer.RealTime();
+         first_its = parabolic.GetNumIterations();
+      }
+      num_steps++;
+      step++;
+      if (*checkpoint_file && step % checkpoint_interval == 0)
+      {
+         write_checkpoint();
+      }
+      out << "time = " << t << ", iterations = "
+          << parabolic.GetNumIterations() - step_its << std::endl;
+      if (vis)
+      {
+         glvis.Update(t);
+      }
+      if (series)
+      {
+         // The last state is always saved
+         series->Write(u, t, t >= t_final);
+      }
+   }
+   if (series) { series->Close(); }
+   timer.Stop();
+   if (num_steps > 1)
+   {
+      // Mean cost of the remaining steps, iterations per step
+      const int steps = num_steps - 1;
+      const int its = parabolic.GetNumIterations() - first_its;
+      bench.Record("ode step", ref_levels, ndofs,
+                   (timer.RealTime() - first_step) / steps, its / steps);
+   }
+   out << "Krylov iterations: " << parabolic.GetNumIterations()
+       << ", per step: "
+       << real_t(parabolic.GetNumIterations()) / max(num_steps, 1)
+       << std::endl;
+   out << "Steps: " << num_steps << ", rejected: "
+       << (stepper ? stepper->GetNumRejected() : 0) << ", wall time: "
+       << timer.RealTime() << " s" << std::endl;
+   out << (dg ? "DG" : "H1") << " unknowns: " << ndofs
+       << ", DOF updates per second: " << real_t(ndofs)*num_steps /
+       timer.RealTime() << std::endl;
+   if (mixed_precision)
+   {
+      size_t matrix_bytes = 0;
+      for (BilinearForm *form : {&diffusion, &mass})
+      {
+         matrix_bytes += form->SpMat().NumNonZeroElems()*(sizeof(real_t) +
+                                                          sizeof(int)) +
+                         (form->SpMat().Height() + 1)*sizeof(int);
+      }
+      const real_t float_bytes = parabolic.MixedPrecisionBytes();
+      out << "Mixed precision: float copies " << float_bytes / 1e6
+          << " MB, double K and M " << matrix_bytes / 1e6 << " MB"
+          << std::endl;
+   }
+   if (vis)
+   {
+      glvis.Flush();
+      glvis.PrintStatistics();
+   }
+   if (num_checkpoints > 0)
+   {
+      const real_t per_checkpoint = checkpoint_time / num_checkpoints;
+      out << "Checkpoints: " << num_checkpoints << ", size: "
+          << checkpoint_bytes / 1e6 << " MB, time per checkpoint: "
+          << per_checkpoint << " s ("
+          << per_checkpoint / (checkpoint_bytes / 1e9) << " s/GB)" << endl;
+      bench.Record("checkpoint", ref_levels, ndofs, per_checkpoint, -1);
+   }
+   if (series)
+   {
+      series->PrintStatistics();
+      if (*paraview_name)
+      {
+         const int n = TimeSeriesWriter::ExportParaView(series_prefix,
+                                                        paraview_name);
+         out << "Exported " << n << " snapshots to ParaView/" << paraview_name
+             << std::endl;
+      }
    }
    out << "L2 error: " << u.ComputeL2Error(u0_cf) << std::endl;
 }
@@ -0,0 +1,248 @@
+#include "mfem.hpp"
+#include "helper.hpp"
+
+using namespace mfem;
+using namespace std;
+
+
+// Parallel version of ParabolicEquation in heat.cpp. The state is the vector
+// of true dofs, and all operators are HypreParMatrix objects.
+class ParParabolicEquation : public TimeDependentOperator
+{
+   // member variables
+private:
+protected:
+   ParBilinearForm &K, &M;
+   std::unique_ptr<HypreParMatrix> Kmat, Mmat;
+   std::unique_ptr<HypreParMatrix> mat; // M + dt*K
+   ParLinearForm &load;
+   Coefficient &load_cf; // time-dependent source of load
+   Vector load_vec; // true dof vector of load
+   mutable CGSolver mass_solver;
+   HypreSmoother mass_prec;
+   CGSolver implicit_solver;
+   std::unique_ptr<HypreBoomerAMG> implicit_prec;
+   mutable Vector y_tmp;
+   bool isOperatorTimeDependent;
+   real_t prev_dt = mfem::infinity();
+public:
+   // member functions
+private:
+   // Reassemble K and M. ParBilinearForm::Assemble adds into the existing
+   // local matrix, so the values are reset first.
+   void AssembleOperators()
+   {
+      for (ParBilinearForm *form : {&K, &M})
+      {
+         form->SpMat() = 0.0;
+         form->Assemble();
+         form->Finalize();
+      }
+      Kmat.reset(K.ParallelAssemble());
+      Mmat.reset(M.ParallelAssemble());
+      mass_solver.SetOperator(*Mmat);
+   }
+
+   // Assemble the load at the time of the operator
+   void AssembleLoad()
+   {
+      load_cf.SetTime(t);
+      load.Assemble();
+      load.ParallelAssemble(load_vec);
+   }
+protected:
+public:
+   ParParabolicEquation(ParBilinearForm &K, ParBilinearForm &M,
+                        ParLinearForm &load, Coefficient &load_cf,
+                        bool isOperatorTimeDependent=false)
+      :TimeDependentOperator(K.ParFESpace()->GetTrueVSize()), K(K), M(M),
+       load(load), load_cf(load_cf), mass_solver(K.ParFESpace()->GetComm()),
+       implicit_solver(K.ParFESpace()->GetComm()),
+       isOperatorTimeDependent(isOperatorTimeDependent)
+   {
+      Kmat.reset(K.ParallelAssemble());
+      Mmat.reset(M.ParallelAssemble());
+
+      mass_solver.SetRelTol(1e-10);
+      mass_solver.SetAbsTol(1e-10);
+      mass_solver.SetMaxIter(1000);
+      mass_solver.SetPrintLevel(0);
+      mass_prec.SetType(HypreSmoother::Jacobi);
+      mass_solver.SetPreconditioner(mass_prec);
+      mass_solver.SetOperator(*Mmat);
+
+      implicit_solver.SetRelTol(1e-10);
+      implicit_solver.SetAbsTol(1e-10);
+      implicit_solver.SetMaxIter(1000);
+      implicit_solver.SetPrintLevel(0);
+   }
+
+   void SetTime(real_t t) override
+   {
+      TimeDependentOperator::SetTime(t);
+      if (isOperatorTimeDependent)
+      {
+         AssembleOperators();
+      }
+      AssembleLoad();
+   }
+
+   // Solve M^{-1}(load - Kx) = y
+   void Mult(const Vector &x, Vector &y) const override
+   {
+      y_tmp = load_vec;
+      Kmat->Mult(-1.0, x, 1.0, y_tmp);
+      mass_solver.Mult(y_tmp, y);
+   }
+
+   void ImplicitSolve(const real_t dt, const Vector &x, Vector &y) override
+   {
+      if (dt != prev_dt || isOperatorTimeDependent)
+      {
+         mat.reset(Add(dt, *Kmat, 1.0, *Mmat));
+         implicit_prec.reset(new HypreBoomerAMG(*mat));
+         implicit_prec->SetPrintLevel(0);
+         implicit_solver.SetPreconditioner(*implicit_prec);
+         implicit_solver.SetOperator(*mat);
+      }
+
+      y_tmp = load_vec;
+      Kmat->Mult(-1.0, x, 1.0, y_tmp);
+
+      implicit_solver.Mult(y_tmp, y);
+
+      prev_dt = dt;
+   }
+};
+
+int main(int argc, char *argv[])
+{
+   Mpi::Init(argc, argv);
+   const int num_procs = Mpi::WorldSize();
+   Hypre::Init();
+
+   int order = 1;
+   int ser_ref_levels = 1;
+   int par_ref_levels = 0;
+   int ode_solver_type = 21;
+   bool vis = false;
+   real_t dt = 0.00001;
+   real_t t_final = 1.0;
+
+   OptionsParser args(argc, argv);
+   args.AddOption(&order, "-o", "--order",
+                  "Polynomial order for the finite element space.");
+   args.AddOption(&ser_ref_levels, "-rs", "--refine-serial",
+                  "Number of uniform refinements before partitioning.");
+   args.AddOption(&par_ref_levels, "-rp", "--refine-parallel",
+                  "Number of uniform refinements after partitioning.");
+   args.AddOption(&dt, "-dt", "--time-step",
+                  "Time step size.");
+   args.AddOption(&t_final, "-tf", "--t-final",
+                  "Final time.");
+   args.AddOption(&vis, "-v", "--visualize", "--no-vis", "--no-visualization",
+                  "-v 1 to visualize the solution.");
+   args.AddOption(&ode_solver_type, "-s", "--ode-solver",
+                  ODESolver::Types.c_str());
+   args.ParseCheck();
+
+
+   Mesh mesh = Mesh::MakeCartesian2D(2, 2, Element::Type::QUADRILATERAL);
+   for (int i=0; i<ser_ref_levels; i++)
+   {
+      mesh.UniformRefinement();
+   }
+   ParMesh pmesh(MPI_COMM_WORLD, mesh);
+   mesh.Clear();
+   for (int i=0; i<par_ref_levels; i++)
+   {
+      pmesh.UniformRefinement();
+   }
+
+   const int dim = pmesh.SpaceDimension();
+
+   real_t t = 0.0;
+
+   H1_FECollection fec(order, dim);
+   ParFiniteElementSpace fes(&pmesh, &fec);
+   const HYPRE_BigInt global_size = fes.GlobalTrueVSize();
+   if (Mpi::Root())
+   {
+      out << "Number of ranks: " << num_procs << ", unknowns: " << global_size
+          << std::endl;
+   }
+
+   constexpr real_t pi = M_PI;
+   // The load is evaluated at the time set by ParParabolicEquation::SetTime
+   FunctionCoefficient load_cf([pi](const Vector &x, real_t t)
+   {
+      return (2*sin(5*t)*std::pow(pi,2.0) + 5*cos(5*t))*cos(pi*x[0])*cos(pi*x[1]);
+   });
+   FunctionCoefficient u0_cf([pi, &t](const Vector &x)
+   {
+      return sin(5*t)*cos(pi*x[0])*cos(pi*x[1]);
+   });
+
+
+   ParGridFunction u_gf(&fes);
+   u_gf.ProjectCoefficient(u0_cf);
+   Vector u;
+   u_gf.GetTrueDofs(u);
+
+   ParLinearForm load(&fes);
+   load.AddDomainIntegrator(new DomainLFIntegrator(load_cf));
+   load.Assemble();
+
+   ParBilinearForm diffusion(&fes);
+   diffusion.AddDomainIntegrator(new DiffusionIntegrator());
+   diffusion.Assemble();
+   diffusion.Finalize();
+   ParBilinearForm mass(&fes);
+   mass.AddDomainIntegrator(new MassIntegrator());
+   mass.Assemble();
+   mass.Finalize();
+
+   ParParabolicEquation parabolic(diffusion, mass, load, load_cf);
+   parabolic.SetTime(t);
+
+   unique_ptr<ODESolver> ode_solver = ODESolver::Select(ode_solver_type);
+   ode_solver->Init(parabolic);
+
+   GLVis glvis("localhost", 19916, true);
+   if (vis)
+   {
+      glvis.Append(u_gf, "u");
+      glvis.Update();
+      glvis.SetBound(0, -1.0, 1.0);
+   }
+   StopWatch timer;
+   timer.Start();
+   int num_steps = 0;
+   while (t < t_final)
+   {
+      real_t dt_real = min(dt, t_final - t);
+      ode_solver->Step(u, t, dt_real);
+      num_steps++;
+      if (Mpi::Root())
+      {
+         out << "time = " << t << std::endl;
+      }
+      if (vis)
+      {
+         u_gf.SetFromTrueDofs(u);
+         glvis.Update();
+      }
+   }
+   timer.Stop();
+   u_gf.SetFromTrueDofs(u);
+   const real_t err = u_gf.ComputeL2Error(u0_cf);
+   if (Mpi::Root())
+   {
+      out << "L2 error: " << err << std::endl;
+      out << "ranks = " << num_procs << ", unknowns = " << global_size
+          << ", steps = " << num_steps << ", wall time = " << timer.RealTime()
+          << " s, time per step = " << timer.RealTime() / num_steps << " s"
+          << std::endl;
+   }
+   return 0;
+}
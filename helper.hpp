@@ -1,16 +1,199 @@
 #ifndef MFEM_HELPER_HPP
 #define MFEM_HELPER_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
 #include "mfem.hpp"
+#ifdef MFEM_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace mfem
 {
 
+/// @brief Collect timed events and write them as a Chrome trace.
+///
+/// The output opens in chrome://tracing or https://ui.perfetto.dev. Tracing is
+/// off until Enable() is called; a disabled TraceScope costs one relaxed
+/// atomic load. Events of all threads are collected, and written when Write()
+/// is called or the program exits.
+/// @example Tracer::Get().Enable("trace.json");
+///          { TraceScope trace("solve"); solver.Mult(b, x); }
+class Tracer
+{
+public:
+   typedef std::chrono::steady_clock clock;
+
+private:
+   struct Event
+   {
+      std::string name, args;
+      const char *category;
+      clock::time_point start, end;
+      int thread;
+   };
+
+   std::string filename;
+   clock::time_point origin;
+   std::mutex mutex; // guards events
+   std::vector<Event> events;
+
+   Tracer() = default;
+
+   static std::atomic<bool> &Flag()
+   {
+      static std::atomic<bool> flag(false);
+      return flag;
+   }
+
+public:
+   ~Tracer() { Write(); }
+
+   static Tracer &Get()
+   {
+      static Tracer tracer;
+      return tracer;
+   }
+
+   static bool Enabled() { return Flag().load(std::memory_order_relaxed); }
+
+   /// Small, stable id of the calling thread, in order of first use.
+   static int ThreadId()
+   {
+      static std::atomic<int> num_threads(0);
+      thread_local int id = num_threads++;
+      return id;
+   }
+
+   /// Start recording; the events are written to @a file. An empty name
+   /// leaves tracing disabled.
+   void Enable(const std::string &file)
+   {
+      if (file.empty()) { return; }
+      filename = file;
+      origin = clock::now();
+      Flag() = true;
+   }
+
+   /// Record an event. @a args is a comma separated list of JSON members,
+   /// e.g. "\"iterations\": 12".
+   void Add(const std::string &name, const char *category,
+            clock::time_point start, clock::time_point end,
+            const std::string &args = "")
+   {
+      if (!Enabled()) { return; }
+      const int thread = ThreadId();
+      std::lock_guard<std::mutex> lock(mutex);
+      events.push_back(Event{name, args, category, start, end, thread});
+   }
+
+   /// Write the events recorded so far in the Chrome trace event format.
+   void Write()
+   {
+      if (!Enabled()) { return; }
+      std::lock_guard<std::mutex> lock(mutex);
+      std::ofstream file(filename);
+      MFEM_VERIFY(file, "Cannot open " << filename);
+      auto us = [this](clock::time_point tp)
+      {
+         return std::chrono::duration<double, std::micro>(tp - origin).count();
+      };
+      file << std::fixed << std::setprecision(3) << "{\"traceEvents\": [\n";
+      for (size_t i=0; i<events.size(); i++)
+      {
+         const Event &e = events[i];
+         file << (i ? ",\n" : "") << "{\"name\": \"" << e.name
+              << "\", \"cat\": \"" << e.category << "\", \"ph\": \"X\", \"ts\": "
+              << us(e.start) << ", \"dur\": " << us(e.end) - us(e.start)
+              << ", \"pid\": 0, \"tid\": " << e.thread << ", \"args\": {"
+              << e.args << "}}";
+      }
+      file << "\n]}\n";
+   }
+};
+
+/// @brief Record the lifetime of a scope as a Tracer event.
+///
+/// Nothing is timed or allocated when tracing is disabled.
+class TraceScope
+{
+   const char *name = nullptr, *category;
+   Tracer::clock::time_point start;
+   std::string args;
+
+public:
+   explicit TraceScope(const char *name, const char *category = "mfem")
+      : category(category)
+   {
+      if (!Tracer::Enabled()) { return; }
+      this->name = name;
+      start = Tracer::clock::now();
+   }
+
+   ~TraceScope()
+   {
+      if (name) { Tracer::Get().Add(name, category, start, Tracer::clock::now(), args); }
+   }
+
+   /// Attach a numeric argument, shown with the event in the viewer.
+   void Arg(const char *key, double value)
+   {
+      if (!name) { return; }
+      std::ostringstream os;
+      os << (args.empty() ? "" : ", ") << "\"" << key << "\": ";
+      if (std::isfinite(value)) { os << value; }
+      else { os << "null"; }
+      args += os.str();
+   }
+
+   /// Attach the iteration count and final residual norm of @a solver.
+   void Arg(const IterativeSolver &solver)
+   {
+      Arg("iterations", solver.GetNumIterations());
+      Arg("final_norm", solver.GetFinalNorm());
+   }
+};
+
+/// @brief Stream grid functions to GLVis.
+///
+/// By default, Update() sends every frame synchronously from the calling
+/// thread. Two options reduce the cost for long time-dependent runs:
+/// - SetMaxRate() drops frames passed to Update(t) that come faster than a
+///   given number of frames per (wall) second or unit of simulated time.
+/// - StartAsync() moves the sockets to a background thread. Update() then
+///   only copies the data into a back buffer; the thread sends the latest
+///   snapshot when it is free, so intermediate frames are coalesced.
+///
+/// The GLVis protocol is text based and expects the mesh with every solution.
+/// The mesh text is therefore serialized once per Mesh::GetSequence() and
+/// reused; only the grid function is serialized on each frame.
 class GLVis
 {
+   typedef std::chrono::steady_clock clock;
+
    Array<mfem::socketstream *> sockets;
    Array<mfem::GridFunction *> gfs;
    Array<Mesh *> meshes;
@@ -19,6 +202,117 @@ class GLVis
    const int port;
    bool secure;
 
+   // rate limiting
+   real_t min_wall_dt = 0.0;
+   real_t min_sim_dt = 0.0;
+   clock::time_point last_frame_wall;
+   real_t last_frame_sim = 0.0;
+   bool rate_started = false;
+   std::atomic<int> frames_sent{0};
+   int frames_dropped = 0;
+
+   // asynchronous mode: the solver writes back, the worker owns front
+   std::thread worker;
+   std::mutex buffer_mutex; // guards back, pending and stop
+   std::mutex socket_mutex; // guards the sockets
+   std::condition_variable buffer_cv;
+   std::vector<Vector> back;
+   std::vector<std::unique_ptr<GridFunction>> front;
+   bool pending = false, stop = false, busy = false;
+
+   // cached mesh text, guarded by socket_mutex
+   std::vector<std::string> mesh_text;
+   std::vector<long> mesh_sequence;
+   long long bytes_sent = 0;
+   real_t send_time = 0.0;
+   int mesh_sends = 0;
+
+   bool IsOpen(int i) { return sockets[i]->is_open() || sockets[i]->good(); }
+
+   const std::string &MeshText(int i)
+   {
+      if (mesh_text.size() != size_t(meshes.Size()))
+      {
+         mesh_text.assign(meshes.Size(), std::string());
+         mesh_sequence.assign(meshes.Size(), -1);
+      }
+      if (mesh_sequence[i] != meshes[i]->GetSequence() || mesh_text[i].empty())
+      {
+         std::ostringstream os;
+         os.precision(8);
+         os << *meshes[i];
+         mesh_text[i] = os.str();
+         mesh_sequence[i] = meshes[i]->GetSequence();
+         mesh_sends++;
+      }
+      return mesh_text[i];
+   }
+
+   void Send(int i, const GridFunction &gf)
+   {
+      if (!IsOpen(i))
+      {
+         return;
+      }
+      TraceScope trace("GLVis::Send", "vis");
+      const clock::time_point start = clock::now();
+      std::ostringstream os;
+      os.precision(8);
+#ifdef MFEM_USE_MPI
+      if (parallel)
+      {
+         os << "parallel " << Mpi::WorldSize() << " " << Mpi::WorldRank() << "\n";
+      }
+#endif
+      os << "solution\n";
+      const std::string header = os.str();
+      const std::string &mesh = MeshText(i);
+      os.str("");
+      os << gf;
+      const std::string field = os.str();
+      *sockets[i] << header << mesh << field << std::flush;
+      const size_t bytes = header.size() + mesh.size() + field.size();
+      bytes_sent += bytes;
+      trace.Arg("bytes", bytes);
+      send_time += std::chrono::duration<real_t>(clock::now() - start).count();
+   }
+
+   void WorkerLoop()
+   {
+      std::unique_lock<std::mutex> lock(buffer_mutex);
+      while (true)
+      {
+         buffer_cv.wait(lock, [this] { return pending || stop; });
+         if (!pending) { break; }
+         for (size_t i=0; i<front.size(); i++)
+         {
+            front[i]->Swap(back[i]);
+         }
+         pending = false;
+         busy = true;
+         lock.unlock();
+         {
+            std::lock_guard<std::mutex> socket_lock(socket_mutex);
+            for (int i=0; i<sockets.Size(); i++) { Send(i, *front[i]); }
+         }
+         lock.lock();
+         busy = false;
+         frames_sent++;
+         buffer_cv.notify_all();
+      }
+   }
+
+   void StopAsync()
+   {
+      if (!worker.joinable()) { return; }
+      {
+         std::lock_guard<std::mutex> lock(buffer_mutex);
+         stop = true;
+      }
+      buffer_cv.notify_all();
+      worker.join();
+   }
+
 public:
 #ifdef MFEM_USE_GNUTLS
    static const bool secure_default = true;
@@ -32,6 +326,7 @@ public:
 
    ~GLVis()
    {
+      StopAsync();
       for (socketstream *socket : sockets)
       {
          if (socket)
@@ -44,15 +339,16 @@ public:
    void Append(GridFunction &gf, const char window_title[] = nullptr,
                const char keys[] = nullptr)
    {
+      MFEM_VERIFY(!worker.joinable(), "Append must be called before StartAsync");
       sockets.Append(new socketstream(hostname, port, secure));
       socketstream *socket = sockets.Last();
+      Mesh *mesh = gf.FESpace()->GetMesh();
+      gfs.Append(&gf);
+      meshes.Append(mesh);
       if (!socket->is_open())
       {
          return;
       }
-      Mesh *mesh = gf.FESpace()->GetMesh();
-      gfs.Append(&gf);
-      meshes.Append(mesh);
       socket->precision(8);
 #ifdef MFEM_USE_MPI
       if (parallel)
@@ -60,7 +356,7 @@ public:
          *socket << "parallel " << Mpi::WorldSize() << " " << Mpi::WorldRank() << "\n";
       }
 #endif
-      *socket << "solution\n" << *mesh << gf;
+      *socket << "solution\n" << MeshText(meshes.Size() - 1) << gf;
       if (keys)
       {
          *socket << "keys " << keys << "\n";
@@ -72,28 +368,102 @@ public:
       *socket << std::flush;
    }
 
+   /// Drop frames passed to Update(t) that come within 1/@a max_fps seconds
+   /// or @a sim_dt units of simulated time of the last frame. Zero disables
+   /// the corresponding limit.
+   void SetMaxRate(real_t max_fps, real_t sim_dt = 0.0)
+   {
+      min_wall_dt = max_fps > 0.0 ? 1.0 / max_fps : 0.0;
+      min_sim_dt = sim_dt;
+   }
+
+   /// Send frames from a background thread. Call after all Append()s.
+   void StartAsync()
+   {
+      if (worker.joinable()) { return; }
+      back.resize(gfs.Size());
+      front.clear();
+      for (GridFunction *gf : gfs)
+      {
+         front.emplace_back(new GridFunction(gf->FESpace()));
+      }
+      stop = false;
+      worker = std::thread(&GLVis::WorkerLoop, this);
+   }
+
+   /// Send the current grid functions. In asynchronous mode, this only copies
+   /// them; a snapshot that has not been sent yet is replaced.
    void Update()
    {
-      for (int i=0; i<sockets.Size(); i++)
+      TraceScope trace("GLVis::Update", "vis");
+      if (!worker.joinable())
       {
-         if (!sockets[i]->is_open() && !sockets[i]->good())
-         {
-            continue;
-         }
-#ifdef MFEM_USE_MPI
-         if (parallel)
-         {
-            *sockets[i] << "parallel " << Mpi::WorldSize() << " " << Mpi::WorldRank() <<
-                           "\n";
-         }
-#endif
-         *sockets[i] << "solution\n" << *meshes[i] << *gfs[i];
-         *sockets[i] << std::flush;
+         for (int i=0; i<sockets.Size(); i++) { Send(i, *gfs[i]); }
+         frames_sent++;
+         return;
+      }
+      {
+         std::lock_guard<std::mutex> lock(buffer_mutex);
+         if (pending) { frames_dropped++; }
+         for (int i=0; i<gfs.Size(); i++) { back[i] = *gfs[i]; }
+         pending = true;
       }
+      buffer_cv.notify_all();
+   }
+
+   /// Rate-limited Update() for the state at simulated time @a t.
+   void Update(real_t t)
+   {
+      const clock::time_point now = clock::now();
+      const real_t wall_dt =
+         std::chrono::duration<real_t>(now - last_frame_wall).count();
+      if (rate_started &&
+          (wall_dt < min_wall_dt || t - last_frame_sim < min_sim_dt))
+      {
+         frames_dropped++;
+         return;
+      }
+      rate_started = true;
+      last_frame_wall = now;
+      last_frame_sim = t;
+      Update();
+   }
+
+   /// Send the current grid functions, ignoring rate limits, and wait until
+   /// the background thread, if any, has sent them.
+   void Flush()
+   {
+      Update();
+      if (!worker.joinable()) { return; }
+      std::unique_lock<std::mutex> lock(buffer_mutex);
+      buffer_cv.wait(lock, [this] { return !pending && !busy; });
+   }
+
+   /// Serialize the meshes again on the next frame, e.g. after moving nodes,
+   /// which does not change Mesh::GetSequence().
+   void MeshChanged()
+   {
+      std::lock_guard<std::mutex> socket_lock(socket_mutex);
+      mesh_text.clear();
+   }
+
+   int GetFramesSent() const { return frames_sent; }
+   int GetFramesDropped() const { return frames_dropped; }
+
+   /// Print the number of frames, bytes and time spent in sending them.
+   void PrintStatistics(std::ostream &os = mfem::out)
+   {
+      std::lock_guard<std::mutex> socket_lock(socket_mutex);
+      const int frames = std::max(int(frames_sent), 1);
+      os << "GLVis frames sent: " << frames_sent << ", dropped: "
+         << frames_dropped << ", mesh serializations: " << mesh_sends
+         << "\nGLVis bytes per frame: " << bytes_sent / frames
+         << ", time per frame: " << send_time / frames << " s" << std::endl;
    }
 
    void Pause()
    {
+      std::lock_guard<std::mutex> socket_lock(socket_mutex);
       for (int i = 0; i < sockets.Size(); i++)
       {
          if (!sockets[i]->is_open() && !sockets[i]->good())
@@ -106,6 +476,7 @@ public:
 
    void SetBound(const int i, const real_t lower, const real_t upper)
    {
+      std::lock_guard<std::mutex> socket_lock(socket_mutex);
       if (!sockets[i]->is_open() && !sockets[i]->good())
       {
          MFEM_ABORT("Socket is not open");
@@ -115,10 +486,2335 @@ public:
    }
 
 
+   /// Direct access to a socket. Not synchronized with the background thread.
    socketstream &GetSocket(int i)
    {
       return *sockets[i];
    }
 };
+
+/// @brief Append snapshots of a grid function to one binary file, from a
+/// background thread.
+///
+/// Snapshots go to <prefix>.bin, one record of raw real_t values (zlib
+/// compressed with MFEM_USE_ZLIB, if requested) after the other. The text
+/// index <prefix>.idx holds the space and one line per record: cycle, time,
+/// byte offset and size. The mesh is saved to <prefix>.mesh, so the series
+/// can be converted with ExportParaView() after the run, or by another
+/// program.
+///
+/// Write() copies the data into a back buffer and returns; the thread
+/// compresses and writes the previous snapshot meanwhile. Write() only waits
+/// if the thread is still busy with the snapshot before that, so no snapshot
+/// is dropped; the time spent waiting is reported by PrintStatistics().
+/// @example TimeSeriesWriter ts("heat", u);
+///          ts.SetInterval(0.01);
+///          while (...) { ode->Step(u, t, dt); ts.Write(u, t); }
+///          ts.Close();
+///          TimeSeriesWriter::ExportParaView("heat", "Heat");
+class TimeSeriesWriter
+{
+   typedef std::chrono::steady_clock clock;
+
+   std::string prefix;
+   bool compress;
+   std::ofstream data, index;
+   long long offset = 0; // of the next record in the data file
+   real_t interval = 0.0, last_t = 0.0;
+   int cycle = 0;
+
+   std::thread worker;
+   std::mutex buffer_mutex;
+   std::condition_variable buffer_cv;
+   Vector back, front;
+   real_t back_t = 0.0;
+   int back_cycle = 0;
+   bool pending = false, stop = false;
+   std::vector<unsigned char> zbuffer;
+
+   // statistics
+   int records = 0;
+   long long raw_bytes = 0;
+   real_t stall_time = 0.0, write_time = 0.0;
+
+   void WriteRecord(const Vector &v, real_t t, int c)
+   {
+      TraceScope trace("TimeSeriesWriter::WriteRecord", "io");
+      const clock::time_point start = clock::now();
+      const char *bytes = reinterpret_cast<const char*>(v.HostRead());
+      long long size = v.Size()*sizeof(real_t);
+#ifdef MFEM_USE_ZLIB
+      if (compress)
+      {
+         uLongf zsize = compressBound(uLong(size));
+         zbuffer.resize(zsize);
+         const int status =
+            compress2(zbuffer.data(), &zsize,
+                      reinterpret_cast<const Bytef*>(bytes), uLong(size),
+                      Z_BEST_SPEED);
+         MFEM_VERIFY(status == Z_OK, "zlib compression failed");
+         bytes = reinterpret_cast<const char*>(zbuffer.data());
+         size = zsize;
+      }
+#endif
+      data.write(bytes, size);
+      // The data is flushed first, so the index never points past the end
+      data.flush();
+      index << c << ' ' << std::setprecision(17) << t << ' ' << offset << ' '
+            << size << std::endl;
+      offset += size;
+      records++;
+      raw_bytes += v.Size()*sizeof(real_t);
+      write_time += std::chrono::duration<real_t>(clock::now() - start).count();
+      trace.Arg("bytes", real_t(size));
+   }
+
+   void WorkerLoop()
+   {
+      std::unique_lock<std::mutex> lock(buffer_mutex);
+      while (true)
+      {
+         buffer_cv.wait(lock, [this] { return pending || stop; });
+         if (!pending) { break; }
+         front.Swap(back);
+         const real_t t = back_t;
+         const int c = back_cycle;
+         pending = false;
+         buffer_cv.notify_all();
+         lock.unlock();
+         WriteRecord(front, t, c);
+         lock.lock();
+      }
+   }
+
+public:
+   /// Open <prefix>.bin and <prefix>.idx for snapshots of grid functions in
+   /// the space of @a u, and save the mesh of @a u.
+   TimeSeriesWriter(const std::string &prefix, const GridFunction &u,
+                    bool compress = false)
+      : prefix(prefix), compress(compress)
+   {
+#ifndef MFEM_USE_ZLIB
+      if (compress)
+      {
+         MFEM_WARNING("MFEM is built without zlib; writing uncompressed");
+         this->compress = false;
+      }
+#endif
+      const FiniteElementSpace &fes = *u.FESpace();
+      fes.GetMesh()->Save(prefix + ".mesh");
+      data.open(prefix + ".bin", std::ios::binary | std::ios::trunc);
+      index.open(prefix + ".idx", std::ios::trunc);
+      MFEM_VERIFY(data && index, "cannot open " << prefix << ".bin/.idx");
+      index << "mfem-time-series " << u.Size() << ' ' << fes.GetVDim() << ' '
+            << fes.GetOrdering() << ' ' << sizeof(real_t) << ' '
+            << this->compress << ' ' << fes.FEColl()->Name() << std::endl;
+      worker = std::thread(&TimeSeriesWriter::WorkerLoop, this);
+   }
+
+   ~TimeSeriesWriter() { Close(); }
+
+   /// Skip snapshots passed to Write() within @a dt units of simulated time
+   /// of the last one written; zero writes every snapshot.
+   void SetInterval(real_t dt) { interval = dt; }
+
+   /// Queue a snapshot of @a u at time @a t, unless it comes within the
+   /// interval of the last one and @a force is false. Returns whether it was
+   /// queued.
+   bool Write(const Vector &u, real_t t, bool force = false)
+   {
+      if (cycle > 0 && !force && t - last_t < interval) { return false; }
+      TraceScope trace("TimeSeriesWriter::Write", "io");
+      const clock::time_point start = clock::now();
+      std::unique_lock<std::mutex> lock(buffer_mutex);
+      MFEM_VERIFY(!stop, "the time series is closed");
+      buffer_cv.wait(lock, [this] { return !pending; });
+      stall_time += std::chrono::duration<real_t>(clock::now() - start).count();
+      back = u;
+      back_t = t;
+      back_cycle = cycle++;
+      pending = true;
+      last_t = t;
+      lock.unlock();
+      buffer_cv.notify_all();
+      return true;
+   }
+
+   /// Write the queued snapshot and close the files.
+   void Close()
+   {
+      if (!worker.joinable()) { return; }
+      {
+         std::lock_guard<std::mutex> lock(buffer_mutex);
+         stop = true;
+      }
+      buffer_cv.notify_all();
+      worker.join();
+      data.close();
+      index.close();
+   }
+
+   /// Print the size and the cost of the series. Call after Close().
+   void PrintStatistics(std::ostream &os = mfem::out) const
+   {
+      const int n = std::max(records, 1);
+      os << "Time series snapshots: " << records << ", bytes: " << offset
+         << " (" << real_t(offset) / std::max(raw_bytes, 1LL)
+         << " of raw)\nTime series write time per snapshot: " << write_time / n
+         << " s, time loop stalled: " << stall_time << " s" << std::endl;
+   }
+
+   /// Save the snapshots of the series @a prefix as the ParaView collection
+   /// @a collection (under ParaView/), with the field named @a field.
+   /// Returns the number of snapshots.
+   static int ExportParaView(const std::string &prefix,
+                             const std::string &collection,
+                             const std::string &field = "u")
+   {
+      std::ifstream index(prefix + ".idx");
+      std::ifstream data(prefix + ".bin", std::ios::binary);
+      MFEM_VERIFY(index && data, "cannot open " << prefix << ".bin/.idx");
+      std::string magic, fec_name;
+      int size, vdim, ordering, real_size, compressed;
+      index >> magic >> size >> vdim >> ordering >> real_size >> compressed
+            >> fec_name;
+      MFEM_VERIFY(magic == "mfem-time-series" && real_size == sizeof(real_t),
+                  "invalid time series " << prefix);
+#ifndef MFEM_USE_ZLIB
+      MFEM_VERIFY(!compressed, "reading compressed series requires zlib");
+#endif
+
+      Mesh mesh(prefix + ".mesh");
+      std::unique_ptr<FiniteElementCollection> fec(
+         FiniteElementCollection::New(fec_name.c_str()));
+      FiniteElementSpace fes(&mesh, fec.get(), vdim, ordering);
+      GridFunction gf(&fes);
+      MFEM_VERIFY(gf.Size() == size, "the space does not match the series");
+
+      const int order = fec->GetOrder();
+      ParaViewDataCollection dc(collection, &mesh);
+      dc.SetPrefixPath("ParaView");
+      dc.SetLevelsOfDetail(order == 1 ? order : order + 3);
+      dc.SetDataFormat(VTKFormat::BINARY);
+      dc.SetHighOrderOutput(true);
+      dc.RegisterField(field, &gf);
+
+      std::vector<char> record;
+      int c, count = 0;
+      real_t t;
+      long long offset, bytes;
+      while (index >> c >> t >> offset >> bytes)
+      {
+         record.resize(bytes);
+         data.seekg(offset);
+         data.read(record.data(), bytes);
+         MFEM_VERIFY(data, "truncated time series " << prefix);
+         real_t *values = gf.HostWrite();
+#ifdef MFEM_USE_ZLIB
+         if (compressed)
+         {
+            uLongf raw = uLongf(size)*sizeof(real_t);
+            const int status =
+               uncompress(reinterpret_cast<Bytef*>(values), &raw,
+                          reinterpret_cast<const Bytef*>(record.data()),
+                          uLong(bytes));
+            MFEM_VERIFY(status == Z_OK && raw == size*sizeof(real_t),
+                        "zlib decompression failed");
+         }
+         else
+#endif
+         {
+            MFEM_VERIFY(bytes == size*(long long)sizeof(real_t),
+                        "invalid record size");
+            std::copy(record.begin(), record.end(),
+                      reinterpret_cast<char*>(values));
+         }
+         dc.SetCycle(c);
+         dc.SetTime(t);
+         dc.Save();
+         count++;
+      }
+      return count;
+   }
+};
+
+/// @brief Named arrays written to one flat binary file, for checkpoints.
+///
+/// The file holds a header, a table of entries (name, offset, size) and the
+/// data of each entry, aligned to 64 bytes, so that MappedCheckpoint can use
+/// the data in place after mapping the file. Vectors and arrays are
+/// referenced, not copied, and must be alive until Write(); scalars and
+/// strings are copied.
+/// @example Checkpoint ckpt;
+///          ckpt.Add("t", t);
+///          ckpt.Add("u", u);
+///          ckpt.Write("heat.ckpt");
+class Checkpoint
+{
+public:
+   static const int name_size = 48;
+   static const size_t alignment = 64;
+
+   struct Header
+   {
+      char magic[8];
+      uint64_t real_size, num_entries, file_size;
+   };
+   struct Entry
+   {
+      char name[name_size];
+      uint64_t offset, bytes;
+   };
+
+private:
+   struct Item
+   {
+      std::string name;
+      const char *data;
+      size_t bytes;
+      std::vector<char> copy; // owned data of scalars and strings
+   };
+   std::vector<Item> items;
+
+   static size_t Align(size_t offset)
+   {
+      return (offset + alignment - 1) / alignment * alignment;
+   }
+
+   void AddItem(const std::string &name, const void *data, size_t bytes,
+                bool copy)
+   {
+      MFEM_VERIFY(name.size() < size_t(name_size),
+                  "checkpoint entry name too long: " << name);
+      Item item;
+      item.name = name;
+      item.data = static_cast<const char*>(data);
+      item.bytes = bytes;
+      if (copy) { item.copy.assign(item.data, item.data + bytes); }
+      items.push_back(std::move(item));
+   }
+
+public:
+   void Add(const std::string &name, const real_t *data, int n)
+   {
+      AddItem(name, data, n*sizeof(real_t), false);
+   }
+   void Add(const std::string &name, const Vector &v)
+   {
+      Add(name, v.HostRead(), v.Size());
+   }
+   void Add(const std::string &name, real_t value)
+   {
+      AddItem(name, &value, sizeof(real_t), true);
+   }
+   void Add(const std::string &name, const std::string &text)
+   {
+      AddItem(name, text.data(), text.size(), true);
+   }
+   void Add(const std::string &name, const int *data, int n)
+   {
+      AddItem(name, data, n*sizeof(int), false);
+   }
+   void Add(const std::string &name, const Array<int> &a)
+   {
+      Add(name, a.GetData(), a.Size());
+   }
+   /// Add the CSR arrays of the finalized matrix @a A as <name>/I, <name>/J
+   /// and <name>/data, and its width as <name>/width.
+   void Add(const std::string &name, const SparseMatrix &A)
+   {
+      MFEM_VERIFY(A.Finalized(), "the matrix must be finalized");
+      Add(name + "/I", A.HostReadI(), A.Height() + 1);
+      Add(name + "/J", A.HostReadJ(), A.NumNonZeroElems());
+      Add(name + "/data", A.HostReadData(), A.NumNonZeroElems());
+      Add(name + "/width", real_t(A.Width()));
+   }
+
+   /// Drop all entries.
+   void Clear() { items.clear(); }
+
+   /// Write the entries to @a filename through a shared memory map and sync
+   /// it to disk. The data is written to a temporary file that replaces
+   /// @a filename only when complete, so a crash during Write() keeps the
+   /// previous checkpoint. Returns the size of the file in bytes.
+   size_t Write(const std::string &filename) const
+   {
+      TraceScope trace("Checkpoint::Write", "io");
+      std::vector<Entry> table(items.size());
+      size_t offset = Align(sizeof(Header) + table.size()*sizeof(Entry));
+      for (size_t i=0; i<items.size(); i++)
+      {
+         std::memset(&table[i], 0, sizeof(Entry));
+         std::strncpy(table[i].name, items[i].name.c_str(), name_size - 1);
+         table[i].offset = offset;
+         table[i].bytes = items[i].bytes;
+         offset = Align(offset + items[i].bytes);
+      }
+      Header header;
+      std::memcpy(header.magic, "MFEMCKP1", 8);
+      header.real_size = sizeof(real_t);
+      header.num_entries = table.size();
+      header.file_size = offset;
+
+#ifndef _WIN32
+      const std::string tmp = filename + ".tmp";
+      const int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      MFEM_VERIFY(fd >= 0, "cannot open " << tmp);
+      MFEM_VERIFY(ftruncate(fd, off_t(offset)) == 0,
+                  "cannot resize " << tmp);
+      void *map = mmap(nullptr, offset, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fd, 0);
+      MFEM_VERIFY(map != MAP_FAILED, "cannot map " << tmp);
+      char *file = static_cast<char*>(map);
+      std::memcpy(file, &header, sizeof(Header));
+      if (!table.empty())
+      {
+         std::memcpy(file + sizeof(Header), table.data(),
+                     table.size()*sizeof(Entry));
+      }
+      for (size_t i=0; i<items.size(); i++)
+      {
+         const char *data = items[i].copy.empty() ? items[i].data
+                            : items[i].copy.data();
+         if (items[i].bytes)
+         {
+            std::memcpy(file + table[i].offset, data, items[i].bytes);
+         }
+      }
+      MFEM_VERIFY(msync(map, offset, MS_SYNC) == 0, "cannot sync " << tmp);
+      munmap(map, offset);
+      ::close(fd);
+      MFEM_VERIFY(std::rename(tmp.c_str(), filename.c_str()) == 0,
+                  "cannot rename " << tmp << " to " << filename);
+#else
+      MFEM_ABORT("Checkpoint requires POSIX memory maps");
+#endif
+      trace.Arg("bytes", real_t(offset));
+      return offset;
+   }
+};
+
+/// @brief Read-only view of a file written by Checkpoint::Write().
+///
+/// The file is memory mapped, so nothing is read until it is used, and
+/// GetVector() returns vectors that alias the mapped data. The map is
+/// private: modifying such a vector copies the page in memory and leaves the
+/// file unchanged.
+class MappedCheckpoint
+{
+   char *map = nullptr;
+   size_t size = 0;
+   const Checkpoint::Header *header = nullptr;
+   const Checkpoint::Entry *table = nullptr;
+
+   const Checkpoint::Entry &Find(const std::string &name) const
+   {
+      for (uint64_t i=0; i<header->num_entries; i++)
+      {
+         if (name == table[i].name) { return table[i]; }
+      }
+      MFEM_ABORT("checkpoint entry not found: " << name);
+      return table[0];
+   }
+
+public:
+   MappedCheckpoint(const std::string &filename)
+   {
+#ifndef _WIN32
+      const int fd = ::open(filename.c_str(), O_RDONLY);
+      MFEM_VERIFY(fd >= 0, "cannot open " << filename);
+      struct stat st;
+      MFEM_VERIFY(fstat(fd, &st) == 0, "cannot stat " << filename);
+      size = size_t(st.st_size);
+      MFEM_VERIFY(size >= sizeof(Checkpoint::Header),
+                  "not a checkpoint: " << filename);
+      void *m = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      MFEM_VERIFY(m != MAP_FAILED, "cannot map " << filename);
+      map = static_cast<char*>(m);
+#else
+      MFEM_ABORT("MappedCheckpoint requires POSIX memory maps");
+#endif
+      header = reinterpret_cast<const Checkpoint::Header*>(map);
+      table = reinterpret_cast<const Checkpoint::Entry*>(
+                 map + sizeof(Checkpoint::Header));
+      MFEM_VERIFY(std::memcmp(header->magic, "MFEMCKP1", 8) == 0 &&
+                  header->file_size == size &&
+                  header->real_size == sizeof(real_t),
+                  "invalid or truncated checkpoint: " << filename);
+   }
+
+   MappedCheckpoint(const MappedCheckpoint&) = delete;
+   MappedCheckpoint &operator=(const MappedCheckpoint&) = delete;
+
+   ~MappedCheckpoint()
+   {
+#ifndef _WIN32
+      if (map) { munmap(map, size); }
+#endif
+   }
+
+   bool Has(const std::string &name) const
+   {
+      for (uint64_t i=0; i<header->num_entries; i++)
+      {
+         if (name == table[i].name) { return true; }
+      }
+      return false;
+   }
+
+   /// Data of the entry @a name, with @a n set to its number of reals.
+   const real_t *GetData(const std::string &name, int &n) const
+   {
+      const Checkpoint::Entry &e = Find(name);
+      n = int(e.bytes / sizeof(real_t));
+      return reinterpret_cast<const real_t*>(map + e.offset);
+   }
+
+   /// Make @a v alias the entry @a name.
+   void GetVector(const std::string &name, Vector &v) const
+   {
+      int n;
+      const real_t *data = GetData(name, n);
+      v.SetDataAndSize(const_cast<real_t*>(data), n);
+   }
+
+   real_t GetScalar(const std::string &name) const
+   {
+      int n;
+      const real_t *data = GetData(name, n);
+      MFEM_VERIFY(n == 1, "checkpoint entry is not a scalar: " << name);
+      return data[0];
+   }
+
+   std::string GetString(const std::string &name) const
+   {
+      const Checkpoint::Entry &e = Find(name);
+      return std::string(map + e.offset, e.bytes);
+   }
+
+   /// Integer data of the entry @a name, with @a n set to its size.
+   const int *GetIntData(const std::string &name, int &n) const
+   {
+      const Checkpoint::Entry &e = Find(name);
+      n = int(e.bytes / sizeof(int));
+      return reinterpret_cast<const int*>(map + e.offset);
+   }
+
+   /// Make @a a alias the integer entry @a name.
+   void GetArray(const std::string &name, Array<int> &a) const
+   {
+      int n;
+      const int *data = GetIntData(name, n);
+      a.MakeRef(const_cast<int*>(data), n);
+   }
+
+   /// New matrix that aliases the CSR arrays added as @a name. It must be
+   /// deleted before this object.
+   SparseMatrix *NewSparseMatrix(const std::string &name) const
+   {
+      int n_I, n_J, n_data;
+      int *I = const_cast<int*>(GetIntData(name + "/I", n_I));
+      int *J = const_cast<int*>(GetIntData(name + "/J", n_J));
+      real_t *data = const_cast<real_t*>(GetData(name + "/data", n_data));
+      MFEM_VERIFY(n_I > 0 && n_J == n_data && I[n_I - 1] == n_J,
+                  "invalid matrix in checkpoint: " << name);
+      const int width = int(GetScalar(name + "/width"));
+      return new SparseMatrix(I, J, data, n_I - 1, width, false, false, false);
+   }
+
+   /// Whether @a filename is a complete checkpoint written with this real_t,
+   /// without aborting if it is not.
+   static bool Check(const std::string &filename)
+   {
+      std::ifstream file(filename, std::ios::binary | std::ios::ate);
+      if (!file) { return false; }
+      const long long size = file.tellg();
+      Checkpoint::Header header;
+      file.seekg(0);
+      if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+      {
+         return false;
+      }
+      return std::memcmp(header.magic, "MFEMCKP1", 8) == 0 &&
+             header.file_size == uint64_t(size) &&
+             header.real_size == sizeof(real_t);
+   }
+};
+
+/// @brief On-disk cache of assembled operators, one file per key.
+///
+/// The key is a string that describes everything the operator depends on,
+/// e.g. the mesh, order, refinement level and integrators. Entries are
+/// Checkpoint files named after a hash of the key, which is also stored in
+/// the file: Load() maps an entry only if its key matches, so any change of
+/// the inputs, or an incomplete or foreign file, leads to a rebuild. The
+/// matrices of a loaded entry alias the mapped file, so they are not copied.
+/// @example OperatorCache cache("cache");
+///          auto entry = cache.Load(key);
+///          if (!entry) { a.Assemble(); ...; cache.Store(key, ckpt); }
+class OperatorCache
+{
+   std::string directory;
+
+public:
+   OperatorCache(const std::string &directory): directory(directory) {}
+
+   /// 64-bit FNV-1a hash of @a text as a hexadecimal string.
+   static std::string Hash(const std::string &text)
+   {
+      uint64_t hash = 14695981039346656037ULL;
+      for (unsigned char c : text)
+      {
+         hash ^= c;
+         hash *= 1099511628211ULL;
+      }
+      std::ostringstream os;
+      os << std::hex << std::setw(16) << std::setfill('0') << hash;
+      return os.str();
+   }
+
+   /// Hash of the full-precision text of @a mesh, for keys.
+   static std::string MeshHash(const Mesh &mesh)
+   {
+      std::ostringstream os;
+      os.precision(17);
+      mesh.Print(os);
+      return Hash(os.str());
+   }
+
+   std::string FileName(const std::string &key) const
+   {
+      return directory + "/operator-" + Hash(key) + ".bin";
+   }
+
+   /// Map the entry of @a key, or return null if there is no valid entry
+   /// for this key.
+   std::unique_ptr<MappedCheckpoint> Load(const std::string &key) const
+   {
+      TraceScope trace("OperatorCache::Load", "io");
+      std::unique_ptr<MappedCheckpoint> entry;
+      const std::string filename = FileName(key);
+      if (!MappedCheckpoint::Check(filename)) { return entry; }
+      entry.reset(new MappedCheckpoint(filename));
+      if (!entry->Has("key") || entry->GetString("key") != key)
+      {
+         entry.reset();
+      }
+      return entry;
+   }
+
+   /// Write @a entry as the entry of @a key, replacing an existing one.
+   void Store(const std::string &key, Checkpoint &entry) const
+   {
+#ifndef _WIN32
+      mkdir(directory.c_str(), 0755); // fails harmlessly if it exists
+#endif
+      entry.Add("key", key);
+      entry.Write(FileName(key));
+   }
+};
+
+/// @brief BilinearForm whose matrix can be set instead of assembled, e.g.
+/// to a matrix from an OperatorCache.
+class CachedBilinearForm : public BilinearForm
+{
+public:
+   using BilinearForm::BilinearForm;
+
+   /// Use the finalized matrix @a A, which is owned by the form, as if it
+   /// had been assembled. Assemble() adds into it.
+   void SetMatrix(SparseMatrix *A)
+   {
+      MFEM_VERIFY(A->Height() == Height() && A->Width() == Width(),
+                  "the matrix does not match the space");
+      delete mat;
+      mat = A;
+   }
+};
+
+/// @brief Time the phases of a run and append them to a CSV file.
+///
+/// Each row holds the run configuration, the phase, the refinement level, the
+/// number of unknowns, the wall time, DOFs per second and Krylov iterations
+/// (-1 when not applicable). The header is written if the file is empty. With
+/// an empty file name, Start() and Record() do nothing. Phases timed with
+/// Start() and Record() are also added to the Tracer, if it is enabled.
+/// @example BenchmarkLog bench("bench.csv", "ex1", order, "full", "gs-pcg");
+///          bench.Start(); a.Assemble(); bench.Record("assemble", level, ndofs);
+class BenchmarkLog
+{
+   std::string filename, config;
+   std::ostringstream rows;
+   StopWatch sw;
+   Tracer::clock::time_point start;
+
+public:
+   BenchmarkLog(const std::string &filename, const std::string &driver,
+                int order, const std::string &assembly, const std::string &solver)
+      : filename(filename)
+   {
+      std::ostringstream os;
+      os << driver << "," << order << "," << assembly << "," << solver;
+      config = os.str();
+   }
+
+   ~BenchmarkLog() { Write(); }
+
+   bool Enabled() const { return !filename.empty(); }
+
+   void Start()
+   {
+      if (Tracer::Enabled()) { start = Tracer::clock::now(); }
+      if (!Enabled()) { return; }
+      sw.Clear();
+      sw.Start();
+   }
+
+   /// Stop the timer started by Start() and record its time for @a phase.
+   void Record(const std::string &phase, int level, long long ndofs,
+               int iterations = -1)
+   {
+      if (Tracer::Enabled())
+      {
+         std::ostringstream args;
+         args << "\"level\": " << level << ", \"ndofs\": " << ndofs;
+         if (iterations >= 0) { args << ", \"iterations\": " << iterations; }
+         Tracer::Get().Add(phase, "phase", start, Tracer::clock::now(),
+                           args.str());
+      }
+      if (!Enabled()) { return; }
+      sw.Stop();
+      Record(phase, level, ndofs, sw.RealTime(), iterations);
+   }
+
+   /// Record a phase timed elsewhere.
+   void Record(const std::string &phase, int level, long long ndofs,
+               real_t seconds, int iterations)
+   {
+      if (!Enabled()) { return; }
+      rows << config << "," << phase << "," << level << "," << ndofs << ","
+           << seconds << "," << (seconds > 0.0 ? ndofs / seconds : 0.0) << ","
+           << iterations << "\n";
+   }
+
+   /// Append the recorded rows to the file. Called by the destructor.
+   void Write()
+   {
+      if (!Enabled() || rows.str().empty()) { return; }
+      std::ofstream file(filename, std::ios::app);
+      MFEM_VERIFY(file, "Cannot open " << filename);
+      file.seekp(0, std::ios::end);
+      if (file.tellp() == 0)
+      {
+         file << "driver,order,assembly,solver,phase,level,ndofs,seconds,"
+              "dofs_per_second,iterations\n";
+      }
+      file << rows.str();
+      rows.str("");
+   }
+};
+
+/// @brief Time-dependent load b(t) = sum_k g_k(t) b_k, where b_k is the
+/// linear form of a fixed spatial coefficient f_k.
+///
+/// Each b_k is assembled once in AddTerm(), so evaluating the load at a new
+/// time costs one AXPY per term instead of a quadrature loop.
+/// @example SeparableLoad load(fes);
+///          load.AddTerm([](real_t t) { return cos(t); }, f);
+///          load.AddTo(t, b); // b += cos(t) * (f, phi_i)
+class SeparableLoad
+{
+   FiniteElementSpace &fes;
+   std::vector<std::function<real_t(real_t)>> time_funcs;
+   std::vector<Vector> spatial_loads;
+
+public:
+   SeparableLoad(FiniteElementSpace &fes): fes(fes) {}
+
+   /// Add the term g(t) f(x). @a f is only used during this call.
+   void AddTerm(std::function<real_t(real_t)> g, Coefficient &f)
+   {
+      LinearForm b(&fes);
+      b.AddDomainIntegrator(new DomainLFIntegrator(f));
+      b.Assemble();
+      time_funcs.push_back(g);
+      spatial_loads.push_back(b);
+   }
+
+   int NumTerms() const { return int(time_funcs.size()); }
+
+   /// Add b(t) to @a load.
+   void AddTo(real_t t, Vector &load) const
+   {
+      for (int k=0; k<NumTerms(); k++)
+      {
+         load.Add(time_funcs[k](t), spatial_loads[k]);
+      }
+   }
+};
+
+/// @brief Coefficient that evaluates many points in one call.
+///
+/// EvalBatch() takes the physical coordinates as structure-of-arrays, so an
+/// implementation can loop over plain arrays that the compiler vectorizes,
+/// instead of one virtual call and Vector per quadrature point. Eval() is
+/// still available, as a batch of one point, so the coefficient works with
+/// every integrator and with GridFunction::ProjectCoefficient() or
+/// ComputeL2Error().
+class BatchedCoefficient : public Coefficient
+{
+public:
+   /// Set values[i] = f(x[i], y[i], z[i]), i = 0, ..., n-1. @a y and @a z
+   /// are nullptr in lower dimensions; the missing coordinates are zero.
+   virtual void EvalBatch(int n, const real_t *x, const real_t *y,
+                          const real_t *z, real_t *values) const = 0;
+
+   real_t Eval(ElementTransformation &T, const IntegrationPoint &ip) override
+   {
+      real_t X[3] = {0.0, 0.0, 0.0};
+      Vector transip(X, T.GetSpaceDim());
+      T.Transform(ip, transip);
+      real_t value;
+      EvalBatch(1, X, X + 1, X + 2, &value);
+      return value;
+   }
+};
+
+// f(x, y, z, t) if the functor takes the time, f(x, y, z) otherwise
+template <typename F>
+inline auto CallBatchedFunction(const F &f, real_t x, real_t y, real_t z,
+                                real_t t, int) -> decltype(f(x, y, z, t))
+{
+   return f(x, y, z, t);
+}
+
+template <typename F>
+inline real_t CallBatchedFunction(const F &f, real_t x, real_t y, real_t z,
+                                  real_t, long)
+{
+   return f(x, y, z);
+}
+
+/// @brief BatchedCoefficient of a functor f(x, y, z) or f(x, y, z, t).
+///
+/// The functor type is a template parameter, so it is inlined into the
+/// EvalBatch() loop. A functor with a fourth argument gets the time of the
+/// coefficient, set with SetTime(), e.g. by the operator that assembles the
+/// load at the stage times of an ODE solver.
+/// @example auto f = MakeBatchedCoefficient(
+///             [](real_t x, real_t y, real_t, real_t t) { return sin(t)*x*y; });
+///          f.SetTime(t);
+template <typename F>
+class BatchedFunctionCoefficient : public BatchedCoefficient
+{
+   F f;
+
+   real_t Call(real_t x, real_t y, real_t z) const
+   {
+      return CallBatchedFunction(f, x, y, z, time, 0);
+   }
+
+public:
+   BatchedFunctionCoefficient(F f): f(f) {}
+
+   void EvalBatch(int n, const real_t *x, const real_t *y, const real_t *z,
+                  real_t *values) const override
+   {
+      // Separate loops, so that each one is a plain vectorizable loop
+      if (z)
+      {
+         for (int i=0; i<n; i++) { values[i] = Call(x[i], y[i], z[i]); }
+      }
+      else if (y)
+      {
+         for (int i=0; i<n; i++) { values[i] = Call(x[i], y[i], 0.0); }
+      }
+      else
+      {
+         for (int i=0; i<n; i++) { values[i] = Call(x[i], 0.0, 0.0); }
+      }
+   }
+};
+
+template <typename F>
+BatchedFunctionCoefficient<F> MakeBatchedCoefficient(F f)
+{
+   return BatchedFunctionCoefficient<F>(f);
+}
+
+/// @brief DomainLFIntegrator for a BatchedCoefficient.
+///
+/// The coefficient is evaluated at all quadrature points of an element in
+/// one call, and the shape functions at the reference quadrature points are
+/// computed once per finite element and rule, so elvect is one small
+/// matrix-vector product. The default rule is the one of DomainLFIntegrator,
+/// and the result agrees with it up to roundoff.
+class BatchedDomainLFIntegrator : public LinearFormIntegrator
+{
+   BatchedCoefficient &f;
+   const FiniteElement *shape_fe = nullptr;
+   const IntegrationRule *shape_ir = nullptr;
+   DenseMatrix shapes, points; // nd x nq and dim x nq
+   Vector coords, values;
+
+public:
+   BatchedDomainLFIntegrator(BatchedCoefficient &f): f(f) {}
+
+   using LinearFormIntegrator::AssembleRHSElementVect;
+   void AssembleRHSElementVect(const FiniteElement &el,
+                               ElementTransformation &T,
+                               Vector &elvect) override
+   {
+      const IntegrationRule *ir = IntRule ? IntRule :
+                                  &IntRules.Get(el.GetGeomType(),
+                                                2*el.GetOrder());
+      const int nd = el.GetDof(), nq = ir->GetNPoints();
+      if (&el != shape_fe || ir != shape_ir)
+      {
+         shapes.SetSize(nd, nq);
+         Vector shape;
+         for (int q=0; q<nq; q++)
+         {
+            shapes.GetColumnReference(q, shape);
+            el.CalcShape(ir->IntPoint(q), shape);
+         }
+         shape_fe = &el;
+         shape_ir = ir;
+      }
+
+      // Physical points, transposed to structure-of-arrays
+      T.Transform(*ir, points);
+      const int sdim = points.Height();
+      coords.SetSize(sdim*nq);
+      for (int q=0; q<nq; q++)
+      {
+         for (int d=0; d<sdim; d++) { coords[d*nq + q] = points(d, q); }
+      }
+      values.SetSize(nq);
+      f.EvalBatch(nq, coords.GetData(),
+                  sdim > 1 ? coords.GetData() + nq : nullptr,
+                  sdim > 2 ? coords.GetData() + 2*nq : nullptr,
+                  values.GetData());
+
+      for (int q=0; q<nq; q++)
+      {
+         const IntegrationPoint &ip = ir->IntPoint(q);
+         T.SetIntPoint(&ip);
+         values[q] *= ip.weight*T.Weight();
+      }
+      elvect.SetSize(nd);
+      shapes.Mult(values, elvect);
+   }
+};
+
+/// @brief Linear form (f, phi_i) of a BatchedCoefficient, with all
+/// quadrature points of the mesh evaluated in one call.
+///
+/// The physical quadrature points, the weights times the Jacobian
+/// determinants and the reference shape functions are computed in the
+/// constructor, so Assemble() is one EvalBatch() over the whole mesh followed
+/// by a product with the shape functions and the scatter to the dofs. This is
+/// meant for loads that are reassembled often, e.g. at every time step, on a
+/// fixed mesh: construct a new object after the mesh changes. The space must
+/// be scalar, with one element type.
+/// @example BatchedDomainLF load(fes, f);
+///          load.Assemble(b); // same as LinearForm with DomainLFIntegrator(f)
+class BatchedDomainLF
+{
+   BatchedCoefficient &f;
+   Table element_dofs;
+   int nq;
+   DenseMatrix shapes; // nd x nq, the same for all elements
+   Vector coords;      // structure-of-arrays, sdim blocks of ne*nq
+   Vector weights, values;
+   Vector elvect;
+
+public:
+   BatchedDomainLF(FiniteElementSpace &fes, BatchedCoefficient &f,
+                   const IntegrationRule *ir = nullptr)
+      : f(f)
+   {
+      Mesh &mesh = *fes.GetMesh();
+      const int ne = mesh.GetNE();
+      MFEM_VERIFY(fes.GetVDim() == 1, "only scalar spaces are supported");
+      MFEM_VERIFY(ne > 0, "empty mesh");
+      MFEM_VERIFY(mesh.GetNumGeometries(mesh.Dimension()) == 1,
+                  "only meshes with one element type are supported");
+      const FiniteElement &el = *fes.GetFE(0);
+      if (!ir) { ir = &IntRules.Get(el.GetGeomType(), 2*el.GetOrder()); }
+      nq = ir->GetNPoints();
+
+      const int nd = el.GetDof();
+      shapes.SetSize(nd, nq);
+      Vector shape;
+      for (int q=0; q<nq; q++)
+      {
+         shapes.GetColumnReference(q, shape);
+         el.CalcShape(ir->IntPoint(q), shape);
+      }
+
+      const int sdim = mesh.SpaceDimension();
+      const int np = ne*nq;
+      coords.SetSize(sdim*np);
+      weights.SetSize(np);
+      values.SetSize(np);
+      DenseMatrix points;
+      Array<int> dofs;
+      element_dofs.MakeI(ne);
+      for (int e=0; e<ne; e++) { element_dofs.AddColumnsInRow(e, nd); }
+      element_dofs.MakeJ();
+      for (int e=0; e<ne; e++)
+      {
+         ElementTransformation &T = *mesh.GetElementTransformation(e);
+         T.Transform(*ir, points);
+         for (int q=0; q<nq; q++)
+         {
+            const IntegrationPoint &ip = ir->IntPoint(q);
+            T.SetIntPoint(&ip);
+            weights[e*nq + q] = ip.weight*T.Weight();
+            for (int d=0; d<sdim; d++)
+            {
+               coords[d*np + e*nq + q] = points(d, q);
+            }
+         }
+         fes.GetElementDofs(e, dofs);
+         element_dofs.AddConnections(e, dofs.GetData(), nd);
+      }
+      element_dofs.ShiftUpI();
+   }
+
+   /// Number of quadrature points evaluated by Assemble().
+   int NumPoints() const { return weights.Size(); }
+
+   /// Set @a b to the linear form at the current state of the coefficient.
+   void Assemble(Vector &b)
+   {
+      const int np = NumPoints(), sdim = coords.Size()/np;
+      real_t *x = coords.GetData();
+      f.EvalBatch(np, x, sdim > 1 ? x + np : nullptr,
+                  sdim > 2 ? x + 2*np : nullptr, values.GetData());
+      values *= weights;
+
+      b = 0.0;
+      const int nd = shapes.Height();
+      elvect.SetSize(nd);
+      for (int e=0; e<element_dofs.Size(); e++)
+      {
+         const Vector qvalues(values.GetData() + e*nq, nq);
+         shapes.Mult(qvalues, elvect);
+         const int *dofs = element_dofs.GetRow(e);
+         for (int i=0; i<nd; i++)
+         {
+            // Negative dofs are orientation-flipped
+            const int dof = dofs[i];
+            if (dof >= 0) { b[dof] += elvect[i]; }
+            else { b[-1-dof] -= elvect[i]; }
+         }
+      }
+   }
+};
+
+/// @brief Call @a f(i) for i = 0, ..., n-1 on @a num_threads threads.
+///
+/// Indices are handed out one at a time, so tasks of uneven cost are
+/// balanced. With one thread, the loop runs on the calling thread.
+inline void ParallelFor(int n, int num_threads,
+                        const std::function<void(int)> &f)
+{
+   num_threads = std::min(num_threads, n);
+   if (num_threads <= 1)
+   {
+      for (int i=0; i<n; i++) { f(i); }
+      return;
+   }
+   std::atomic<int> next(0);
+   std::vector<std::thread> threads;
+   for (int t=0; t<num_threads; t++)
+   {
+      threads.emplace_back([&]()
+      {
+         for (int i = next++; i < n; i = next++) { f(i); }
+      });
+   }
+   for (std::thread &thread : threads) { thread.join(); }
+}
+
+/// @brief Set boundary attributes from a list of (attribute, predicate)
+/// rules in one pass.
+///
+/// The centroids of all boundary elements (the mean of their vertices) are
+/// computed once per mesh sequence into one contiguous array. Apply()
+/// evaluates the rules for all boundary elements on the given number of
+/// threads, and calls Mesh::SetAttributes() once at the end. When several
+/// rules match, the last one wins, as with consecutive calls of one rule
+/// each.
+/// @example BoundaryTagger tagger(mesh, 4);
+///          tagger.AddRule(5, [](const Vector &x) { return x[0] < 1e-9; });
+///          tagger.AddRule(6, [](const Vector &x) { return x[1] < 1e-9; });
+///          tagger.Apply();
+class BoundaryTagger
+{
+public:
+   typedef std::function<bool(const Vector &x)> Predicate;
+
+private:
+   Mesh &mesh;
+   int num_threads;
+   std::vector<std::pair<int, Predicate>> rules;
+   std::vector<real_t> centroids; // sdim values per boundary element
+   long sequence = -1;
+
+   // Split [0, n) into about 16 ranges per thread, for balance
+   void ForRanges(int n, const std::function<void(int, int)> &f) const
+   {
+      const int num_ranges = std::max(1, std::min(n, 16*num_threads));
+      ParallelFor(num_ranges, num_threads, [&](int r)
+      {
+         f(int((long long)n*r/num_ranges),
+           int((long long)n*(r + 1)/num_ranges));
+      });
+   }
+
+public:
+   BoundaryTagger(Mesh &mesh, int num_threads = 1)
+      : mesh(mesh), num_threads(std::max(num_threads, 1)) {}
+
+   /// Set the attribute of boundary elements whose centroid satisfies
+   /// @a marker to @a attr. The predicate may be called from several threads
+   /// at once.
+   void AddRule(int attr, Predicate marker)
+   {
+      rules.emplace_back(attr, marker);
+   }
+
+   void ClearRules() { rules.clear(); }
+
+   /// Compute the centroids, unless the mesh has not changed since the last
+   /// call.
+   void ComputeCentroids()
+   {
+      if (sequence == mesh.GetSequence() &&
+          centroids.size() == size_t(mesh.GetNBE())*mesh.SpaceDimension())
+      {
+         return;
+      }
+      TraceScope trace("BoundaryTagger::ComputeCentroids");
+      const Mesh &m = mesh;
+      const int sdim = m.SpaceDimension();
+      centroids.assign(size_t(m.GetNBE())*sdim, 0.0);
+      ForRanges(m.GetNBE(), [&](int begin, int end)
+      {
+         for (int i = begin; i < end; i++)
+         {
+            const Element *el = m.GetBdrElement(i);
+            const int nv = el->GetNVertices();
+            const int *v = el->GetVertices();
+            real_t *c = &centroids[size_t(i)*sdim];
+            for (int k=0; k<nv; k++)
+            {
+               const real_t *coord = m.GetVertex(v[k]);
+               for (int d=0; d<sdim; d++) { c[d] += coord[d]; }
+            }
+            for (int d=0; d<sdim; d++) { c[d] /= nv; }
+         }
+      });
+      sequence = mesh.GetSequence();
+   }
+
+   /// Apply the rules to all boundary elements. Returns the number of
+   /// boundary elements whose attribute changed.
+   int Apply()
+   {
+      ComputeCentroids();
+      TraceScope trace("BoundaryTagger::Apply");
+      const int nbe = mesh.GetNBE(), sdim = mesh.SpaceDimension();
+      const int num_rules = int(rules.size());
+      // Index of the last matching rule of each element, -1 if none
+      std::vector<int> match(nbe, -1);
+      ForRanges(nbe, [&](int begin, int end)
+      {
+         Vector x;
+         for (int i = begin; i < end; i++)
+         {
+            x.SetDataAndSize(&centroids[size_t(i)*sdim], sdim);
+            for (int r = num_rules - 1; r >= 0; r--)
+            {
+               if (rules[r].second(x)) { match[i] = r; break; }
+            }
+         }
+      });
+
+      int changed = 0;
+      for (int i=0; i<nbe; i++)
+      {
+         if (match[i] < 0) { continue; }
+         const int attr = rules[match[i]].first;
+         if (mesh.GetBdrAttribute(i) != attr)
+         {
+            mesh.SetBdrAttribute(i, attr);
+            changed++;
+         }
+      }
+      mesh.SetAttributes();
+      trace.Arg("changed", changed);
+      return changed;
+   }
+};
+
+/// @brief Multi-threaded element assembly of domain integrators on a
+/// scalar, conforming space.
+///
+/// Element matrices and vectors are computed in parallel, each thread with
+/// its own integrators (created by the given factories), finite element
+/// collection and element transformation, since these hold scratch data.
+/// They are then summed into the result by rows: each thread owns a range of
+/// dofs and adds their contributions in the order of serial assembly.
+/// BilinearForm::Assemble() first sums the integrators into one element
+/// matrix and then adds the elements in increasing order, which Assemble()
+/// for matrices repeats. LinearForm::Assemble() adds all elements of one
+/// integrator before the next integrator, so Assemble() for vectors loops
+/// over the integrators, and over the elements in increasing order inside.
+/// With the same additions in the same order, the result is bit-for-bit the
+/// same as serial assembly for any number of threads.
+///
+/// Matrices are assembled into an existing finalized pattern, e.g. from a
+/// first serial BilinearForm::Assemble(). Coefficients must be thread-safe
+/// to evaluate (constant or function coefficients are), and the mesh must not
+/// be curved, since the nodal element transformations share scratch data.
+/// @example ThreadedAssembler ta(fes, 4);
+///          ta.AddDomainIntegrator([]() { return new MassIntegrator; });
+///          ta.Assemble(mass.SpMat()); // same values as mass.Assemble()
+class ThreadedAssembler
+{
+public:
+   typedef std::function<BilinearFormIntegrator*()> BilinearFactory;
+   typedef std::function<LinearFormIntegrator*()> LinearFactory;
+
+private:
+   FiniteElementSpace &fes;
+   const int num_threads;
+   std::vector<BilinearFactory> bilinear;
+   std::vector<LinearFactory> linear;
+   std::vector<std::unique_ptr<FiniteElementCollection>> fecs; // per thread
+   Table dof_element; // elements of each dof, in increasing order
+   Array<int> dof_local; // local index of the dof in each dof_element entry
+   long sequence = -1; // of fes when dof_element was built
+   Array<int> offsets; // element e has values offsets[e], ..., offsets[e+1]-1
+   std::vector<real_t> values;
+
+   const Table &ElementDofs() const { return fes.GetElementToDofTable(); }
+
+   void Setup()
+   {
+      if (sequence == fes.GetSequence()) { return; }
+      sequence = fes.GetSequence();
+      MFEM_VERIFY(fes.GetVDim() == 1 && fes.Conforming(),
+                  "ThreadedAssembler: scalar conforming spaces only");
+      fes.BuildElementToDofTable();
+      Transpose(ElementDofs(), dof_element, fes.GetNDofs());
+      // Fill dof_local in the order Transpose filled dof_element
+      const Table &e2d = ElementDofs();
+      Array<int> next(fes.GetNDofs());
+      for (int i=0; i<next.Size(); i++) { next[i] = dof_element.GetI()[i]; }
+      dof_local.SetSize(dof_element.Size_of_connections());
+      for (int e=0; e<e2d.Size(); e++)
+      {
+         const int *dofs = e2d.GetRow(e);
+         for (int li=0; li<e2d.RowSize(e); li++)
+         {
+            const int q = next[dofs[li]]++;
+            MFEM_ASSERT(dof_element.GetJ()[q] == e, "unexpected dof order");
+            dof_local[q] = li;
+         }
+      }
+      fecs.clear();
+      for (int t=0; t<num_threads; t++)
+      {
+         fecs.emplace_back(FiniteElementCollection::New(fes.FEColl()->Name()));
+      }
+   }
+
+   // Call element(e, fe, T, thread) for all elements, in contiguous ranges
+   // of elements per thread.
+   void ForEachElement(const std::function<void(int, const FiniteElement &,
+                                                ElementTransformation &, int)> &element)
+   {
+      const int ne = fes.GetNE();
+      const Mesh &mesh = *fes.GetMesh();
+      auto visit = [&](int e, int t, IsoparametricTransformation &T)
+      {
+         mesh.GetElementTransformation(e, &T);
+         const FiniteElement &fe = *fecs[t]->FiniteElementForGeometry(
+                                      mesh.GetElementBaseGeometry(e));
+         element(e, fe, T, t);
+      };
+      // IntRules creates quadrature rules on first use, which is not
+      // thread-safe, so one element of each geometry is visited serially.
+      IsoparametricTransformation T0;
+      Array<bool> seen(Geometry::NUM_GEOMETRIES);
+      seen = false;
+      for (int e=0; e<ne; e++)
+      {
+         const Geometry::Type geom = mesh.GetElementBaseGeometry(e);
+         if (!seen[geom]) { seen[geom] = true; visit(e, 0, T0); }
+      }
+      ParallelFor(num_threads, num_threads, [&](int t)
+      {
+         IsoparametricTransformation T;
+         for (int e = t*ne/num_threads; e < (t + 1)*ne/num_threads; e++)
+         {
+            visit(e, t, T);
+         }
+      });
+   }
+
+   // Call row(i, thread) for all dofs, in contiguous ranges per thread
+   void ForEachDof(const std::function<void(int, int)> &row)
+   {
+      const int ndofs = fes.GetNDofs();
+      ParallelFor(num_threads, num_threads, [&](int t)
+      {
+         for (int i = t*ndofs/num_threads; i < (t + 1)*ndofs/num_threads; i++)
+         {
+            row(i, t);
+         }
+      });
+   }
+
+   // Element value offsets with @a per_dof values per element dof, or per
+   // pair of element dofs if @a per_dof is 0
+   void SetOffsets(int per_dof)
+   {
+      const Table &e2d = ElementDofs();
+      offsets.SetSize(fes.GetNE() + 1);
+      offsets[0] = 0;
+      for (int e=0; e<fes.GetNE(); e++)
+      {
+         const int nd = e2d.RowSize(e);
+         offsets[e+1] = offsets[e] + (per_dof ? per_dof*nd : nd*nd);
+      }
+      values.resize(offsets.Last());
+   }
+
+public:
+   ThreadedAssembler(FiniteElementSpace &fes, int num_threads)
+      : fes(fes), num_threads(std::max(num_threads, 1)) {}
+
+   void AddDomainIntegrator(BilinearFactory f) { bilinear.push_back(f); }
+   void AddDomainIntegrator(LinearFactory f) { linear.push_back(f); }
+
+   /// Overwrite the values of the finalized matrix @a A with the sum of the
+   /// bilinear integrators. Its pattern must contain all element couplings
+   /// with nonzero values.
+   void Assemble(SparseMatrix &A)
+   {
+      MFEM_VERIFY(A.Finalized(), "ThreadedAssembler: matrix must be finalized");
+      MFEM_VERIFY(!bilinear.empty(), "ThreadedAssembler: no integrators");
+      Setup();
+      SetOffsets(0);
+      const Table &e2d = ElementDofs();
+      std::vector<std::vector<std::unique_ptr<BilinearFormIntegrator>>>
+            integs(num_threads);
+      for (auto &thread_integs : integs)
+      {
+         for (const BilinearFactory &f : bilinear) { thread_integs.emplace_back(f()); }
+      }
+
+      // Element matrices, summed over the integrators as in BilinearForm
+      ForEachElement([&](int e, const FiniteElement &fe,
+                         ElementTransformation &T, int t)
+      {
+         const int nd = e2d.RowSize(e);
+         DenseMatrix elmat(values.data() + offsets[e], nd, nd), elmat_k;
+         integs[t][0]->AssembleElementMatrix(fe, T, elmat);
+         for (size_t k=1; k<integs[t].size(); k++)
+         {
+            integs[t][k]->AssembleElementMatrix(fe, T, elmat_k);
+            elmat += elmat_k;
+         }
+      });
+
+      // Rows of A, each summed in increasing element order. position maps a
+      // column to its entry in the current row.
+      const int *I = A.HostReadI(), *J = A.HostReadJ();
+      real_t *data = A.HostReadWriteData();
+      std::vector<Array<int>> position(num_threads);
+      for (Array<int> &pos : position)
+      {
+         pos.SetSize(A.Width());
+         pos = -1;
+      }
+      ForEachDof([&](int i, int t)
+      {
+         Array<int> &pos = position[t];
+         for (int p=I[i]; p<I[i+1]; p++) { pos[J[p]] = p; data[p] = 0.0; }
+         for (int q=dof_element.GetI()[i]; q<dof_element.GetI()[i+1]; q++)
+         {
+            const int e = dof_element.GetJ()[q];
+            const int nd = e2d.RowSize(e), li = dof_local[q];
+            const int *dofs = e2d.GetRow(e);
+            const real_t *elmat = values.data() + offsets[e];
+            for (int lj=0; lj<nd; lj++)
+            {
+               const real_t v = elmat[li + lj*nd]; // column-major
+               const int p = pos[dofs[lj]];
+               if (p < 0)
+               {
+                  MFEM_VERIFY(v == 0.0, "ThreadedAssembler: entry (" << i << ","
+                              << dofs[lj] << ") is not in the pattern");
+                  continue;
+               }
+               data[p] += v;
+            }
+         }
+         for (int p=I[i]; p<I[i+1]; p++) { pos[J[p]] = -1; }
+      });
+   }
+
+   /// Overwrite @a b with the sum of the linear integrators.
+   void Assemble(Vector &b)
+   {
+      MFEM_VERIFY(!linear.empty(), "ThreadedAssembler: no integrators");
+      Setup();
+      const int nk = int(linear.size());
+      SetOffsets(nk);
+      const Table &e2d = ElementDofs();
+      std::vector<std::vector<std::unique_ptr<LinearFormIntegrator>>>
+            integs(num_threads);
+      for (auto &thread_integs : integs)
+      {
+         for (const LinearFactory &f : linear) { thread_integs.emplace_back(f()); }
+      }
+
+      // Element vectors of each integrator, kept apart since LinearForm adds
+      // them to the result one at a time
+      ForEachElement([&](int e, const FiniteElement &fe,
+                         ElementTransformation &T, int t)
+      {
+         const int nd = e2d.RowSize(e);
+         for (int k=0; k<nk; k++)
+         {
+            Vector elvec(values.data() + offsets[e] + k*nd, nd);
+            integs[t][k]->AssembleRHSElementVect(fe, T, elvec);
+         }
+      });
+
+      b.SetSize(fes.GetVSize());
+      real_t *data = b.HostWrite();
+      ForEachDof([&](int i, int)
+      {
+         data[i] = 0.0;
+         for (int k=0; k<nk; k++)
+         {
+            for (int q=dof_element.GetI()[i]; q<dof_element.GetI()[i+1]; q++)
+            {
+               const int e = dof_element.GetJ()[q];
+               const int nd = e2d.RowSize(e);
+               data[i] += values[offsets[e] + k*nd + dof_local[q]];
+            }
+         }
+      });
+   }
+};
+
+/// @brief Linear combination A = sum_k c_k A_k of finalized sparse matrices.
+///
+/// The merged sparsity pattern of all terms, and the position of every term
+/// entry inside it, are computed once on the first call to Update(). Later
+/// calls only overwrite the values, so the returned matrix keeps its address
+/// and solvers or preconditioners attached to it remain valid.
+/// @example SparseMatrixSum sum; sum.AddTerm(M); sum.AddTerm(K);
+///          const real_t coeff[] = {1.0, dt};
+///          cg.SetOperator(sum.Update(coeff)); // M + dt*K
+class SparseMatrixSum
+{
+   Array<const SparseMatrix *> terms;
+   std::vector<Array<int>> maps; // term entry -> merged entry
+   std::unique_ptr<SparseMatrix> mat;
+
+   // data = sum_k coeff[k] A_k on the merged pattern
+   void Combine(const real_t coeff[], real_t *data) const
+   {
+      std::fill(data, data + mat->NumNonZeroElems(), 0.0);
+      for (int k=0; k<terms.Size(); k++)
+      {
+         const real_t *Ak = terms[k]->HostReadData();
+         const int *map = maps[k].GetData();
+         const real_t c = coeff[k];
+         for (int p=0; p<maps[k].Size(); p++)
+         {
+            data[map[p]] += c*Ak[p];
+         }
+      }
+   }
+
+   void BuildPattern()
+   {
+      const int height = terms[0]->Height();
+      const int width = terms[0]->Width();
+      for (const SparseMatrix *A : terms)
+      {
+         MFEM_VERIFY(A->Finalized(), "SparseMatrixSum: terms must be finalized");
+         MFEM_VERIFY(A->Height() == height && A->Width() == width,
+                     "SparseMatrixSum: incompatible term sizes");
+      }
+
+      // Row sizes of the union pattern
+      int *I = new int[height + 1];
+      Array<int> marker(width);
+      marker = -1;
+      I[0] = 0;
+      for (int i=0; i<height; i++)
+      {
+         int nnz_row = 0;
+         for (const SparseMatrix *A : terms)
+         {
+            const int *Ai = A->HostReadI(), *Aj = A->HostReadJ();
+            for (int p=Ai[i]; p<Ai[i+1]; p++)
+            {
+               if (marker[Aj[p]] != i) { marker[Aj[p]] = i; nnz_row++; }
+            }
+         }
+         I[i+1] = I[i] + nnz_row;
+      }
+
+      // Sorted column indices of the union pattern
+      int *J = new int[I[height]];
+      marker = -1;
+      for (int i=0; i<height; i++)
+      {
+         int pos = I[i];
+         for (const SparseMatrix *A : terms)
+         {
+            const int *Ai = A->HostReadI(), *Aj = A->HostReadJ();
+            for (int p=Ai[i]; p<Ai[i+1]; p++)
+            {
+               if (marker[Aj[p]] != i) { marker[Aj[p]] = i; J[pos++] = Aj[p]; }
+            }
+         }
+         std::sort(J + I[i], J + I[i+1]);
+      }
+
+      real_t *data = new real_t[I[height]];
+      std::fill(data, data + I[height], 0.0);
+      mat.reset(new SparseMatrix(I, J, data, height, width, true, true, true));
+
+      // Position of each term entry in the merged pattern
+      maps.resize(terms.Size());
+      for (int k=0; k<terms.Size(); k++)
+      {
+         const int *Ai = terms[k]->HostReadI(), *Aj = terms[k]->HostReadJ();
+         maps[k].SetSize(terms[k]->NumNonZeroElems());
+         for (int i=0; i<height; i++)
+         {
+            for (int p=Ai[i]; p<Ai[i+1]; p++)
+            {
+               maps[k][p] = int(std::lower_bound(J + I[i], J + I[i+1], Aj[p]) - J);
+            }
+         }
+      }
+   }
+
+public:
+   /// Add @a A as a term. @a A must outlive this object, and its sparsity
+   /// pattern must not change after the first Update(); call Reset() if it does.
+   void AddTerm(const SparseMatrix &A)
+   {
+      terms.Append(&A);
+      Reset();
+   }
+
+   int NumTerms() const { return terms.Size(); }
+
+   /// Forget the merged pattern. It is rebuilt on the next Update().
+   void Reset() { mat.reset(); maps.clear(); }
+
+   /// Overwrite the values with sum_k coeff[k] A_k and return the result.
+   SparseMatrix &Update(const real_t coeff[])
+   {
+      MFEM_VERIFY(terms.Size() > 0, "SparseMatrixSum: no terms");
+      if (!mat) { BuildPattern(); }
+
+      Combine(coeff, mat->HostReadWriteData());
+      return *mat;
+   }
+
+   /// Return a new matrix sum_k coeff[k] A_k that shares the row and column
+   /// arrays of the merged pattern and owns only its values, e.g. for an
+   /// ensemble of systems. It must not outlive this object or a Reset(). Once
+   /// the pattern is built by a first call, further calls are thread-safe.
+   SparseMatrix *NewCombination(const real_t coeff[])
+   {
+      MFEM_VERIFY(terms.Size() > 0, "SparseMatrixSum: no terms");
+      if (!mat) { BuildPattern(); }
+      const int nnz = mat->NumNonZeroElems();
+      real_t *data = new real_t[nnz];
+      Combine(coeff, data);
+      return new SparseMatrix(mat->GetI(), mat->GetJ(), data, mat->Height(),
+                              mat->Width(), false, true, true);
+   }
+
+   /// The combined matrix as of the last Update()
+   SparseMatrix &GetMatrix()
+   {
+      MFEM_VERIFY(mat, "SparseMatrixSum: Update() has not been called");
+      return *mat;
+   }
+};
+
+/// @brief Y = A X for a block of vectors stored as the columns of X.
+///
+/// Every row of A is read once and applied to all columns, so the matrix is
+/// streamed from memory once per product instead of once per vector.
+inline void SpMM(const SparseMatrix &A, const DenseMatrix &X, DenseMatrix &Y)
+{
+   MFEM_VERIFY(A.Width() == X.Height(), "SpMM: incompatible sizes");
+   const int n = A.Height(), m = X.Height(), k = X.Width();
+   Y.SetSize(n, k);
+   const int *I = A.HostReadI(), *J = A.HostReadJ();
+   const real_t *a = A.HostReadData();
+   const real_t *x = X.Data();
+   real_t *y = Y.Data();
+   for (int i=0; i<n; i++)
+   {
+      for (int c=0; c<k; c++)
+      {
+         const real_t *xc = x + c*m;
+         real_t sum = 0.0;
+         for (int p=I[i]; p<I[i+1]; p++) { sum += a[p]*xc[J[p]]; }
+         y[i + c*n] = sum;
+      }
+   }
+}
+
+/// @brief Jacobi-preconditioned CG on all columns of a block at once.
+///
+/// The columns are independent CG iterations run in lock-step: each
+/// iteration applies A to the whole block with SpMM(), and the scalars
+/// alpha and beta are kept per column. A column stops updating once its
+/// preconditioned residual satisfies the tolerances, as in CGSolver.
+class LockstepCG
+{
+   const SparseMatrix *A = nullptr;
+   Vector dinv; // inverse diagonal of A
+   real_t rel_tol = 1e-6, abs_tol = 0.0;
+   int max_iter = 1000;
+   mutable Array<int> iterations;
+
+public:
+   void SetOperator(const SparseMatrix &op)
+   {
+      A = &op;
+      A->GetDiag(dinv);
+      for (int i=0; i<dinv.Size(); i++) { dinv(i) = 1.0 / dinv(i); }
+   }
+   void SetRelTol(real_t tol) { rel_tol = tol; }
+   void SetAbsTol(real_t tol) { abs_tol = tol; }
+   void SetMaxIter(int n) { max_iter = n; }
+
+   /// Solve A X = B; the columns of X are the initial guesses.
+   void Mult(const DenseMatrix &B, DenseMatrix &X) const
+   {
+      MFEM_VERIFY(A, "LockstepCG: no operator");
+      const int n = B.Height(), k = B.Width();
+      DenseMatrix R(n, k), Z(n, k), P(n, k), AP(n, k);
+      std::vector<real_t> rz(k), tol(k);
+      std::vector<bool> active(k, true);
+      iterations.SetSize(k);
+      iterations = 0;
+
+      SpMM(*A, X, AP);
+      for (int c=0; c<k; c++)
+      {
+         const real_t *b = B.GetColumn(c), *ap = AP.GetColumn(c),
+                       *d = dinv.GetData();
+         real_t *r = R.GetColumn(c), *z = Z.GetColumn(c), *p = P.GetColumn(c);
+         real_t dot = 0.0;
+         for (int i=0; i<n; i++)
+         {
+            r[i] = b[i] - ap[i];
+            z[i] = p[i] = d[i]*r[i];
+            dot += r[i]*z[i];
+         }
+         rz[c] = dot;
+         tol[c] = std::max(rel_tol*rel_tol*dot, abs_tol*abs_tol);
+         active[c] = dot > tol[c];
+      }
+
+      int num_active = int(std::count(active.begin(), active.end(), true));
+      for (int it=0; it<max_iter && num_active > 0; it++)
+      {
+         SpMM(*A, P, AP);
+         for (int c=0; c<k; c++)
+         {
+            if (!active[c]) { continue; }
+            const real_t *ap = AP.GetColumn(c), *d = dinv.GetData();
+            real_t *x = X.GetColumn(c), *r = R.GetColumn(c),
+                    *z = Z.GetColumn(c), *p = P.GetColumn(c);
+            real_t pap = 0.0;
+            for (int i=0; i<n; i++) { pap += p[i]*ap[i]; }
+            const real_t alpha = rz[c] / pap;
+            real_t dot = 0.0;
+            for (int i=0; i<n; i++)
+            {
+               x[i] += alpha*p[i];
+               r[i] -= alpha*ap[i];
+               z[i] = d[i]*r[i];
+               dot += r[i]*z[i];
+            }
+            const real_t beta = dot / rz[c];
+            rz[c] = dot;
+            for (int i=0; i<n; i++) { p[i] = z[i] + beta*p[i]; }
+            iterations[c]++;
+            if (dot <= tol[c])
+            {
+               // Keep the converged column out of the remaining updates
+               active[c] = false;
+               std::fill(p, p + n, 0.0);
+               num_active--;
+            }
+         }
+      }
+   }
+
+   /// Iterations of each column in the last Mult()
+   const Array<int> &GetNumIterations() const { return iterations; }
+};
+
+/// @brief Initial guesses for a sequence of linear solves A x_n = b_n whose
+/// solutions change slowly, e.g. one per time step.
+///
+/// - PREVIOUS uses the last solution.
+/// - EXTRAPOLATE extrapolates the last two solutions linearly in time.
+/// - PROJECTION (Fischer, 1998) keeps an A-orthonormal basis of previous
+///   solutions and returns the A-norm best approximation of x_n in its span,
+///   which needs only dot products with b_n. This recycles the part of the
+///   Krylov information that the solutions carry; A must be SPD. The basis is
+///   restarted from the newest solution when it is full.
+///
+/// Call Guess() before and Add() after each solve, with the solver in
+/// iterative mode. With NONE, both do nothing.
+class WarmStart
+{
+public:
+   enum Type { NONE, PREVIOUS, EXTRAPOLATE, PROJECTION };
+
+private:
+   Type type;
+   const int max_vectors;
+   std::vector<Vector> history; // last two solutions, newest last
+   std::vector<real_t> times;
+   std::vector<Vector> basis, A_basis; // p_i with p_i^T A p_j = delta_ij, A p_i
+
+public:
+   WarmStart(Type type = NONE, int max_vectors = 8)
+      : type(type), max_vectors(max_vectors) {}
+
+   Type GetType() const { return type; }
+   void SetType(Type new_type) { type = new_type; Reset(); }
+
+   /// Overwrite @a x with the initial guess for A x = @a b at time @a t.
+   /// Without stored solutions, @a x is left unchanged.
+   void Guess(const Vector &b, Vector &x, real_t t) const
+   {
+      switch (type)
+      {
+         case NONE: break;
+         case PREVIOUS:
+            if (history.size() > 0) { x = history.back(); }
+            break;
+         case EXTRAPOLATE:
+            if (history.size() == 1 || (history.size() == 2 && times[0] == times[1]))
+            {
+               x = history.back();
+            }
+            else if (history.size() == 2)
+            {
+               const real_t s = (t - times[1]) / (times[1] - times[0]);
+               add(1.0 + s, history[1], -s, history[0], x);
+            }
+            break;
+         case PROJECTION:
+            if (basis.empty()) { break; }
+            x = 0.0;
+            for (const Vector &p : basis) { x.Add(p * b, p); }
+            break;
+      }
+   }
+
+   /// Store the solution @a x of A x = b at time @a t.
+   void Add(const Operator &A, const Vector &x, real_t t)
+   {
+      switch (type)
+      {
+         case NONE: break;
+         case PREVIOUS:
+         case EXTRAPOLATE:
+            if (history.size() == 2)
+            {
+               history[0].Swap(history[1]);
+               std::swap(times[0], times[1]);
+               history.pop_back();
+               times.pop_back();
+            }
+            history.push_back(x);
+            times.push_back(t);
+            break;
+         case PROJECTION:
+         {
+            if (int(basis.size()) == max_vectors) { OperatorChanged(); }
+            // Gram-Schmidt in the A inner product, (p_i, x)_A = (A p_i, x)
+            Vector q(x), Aq(x.Size());
+            for (size_t i=0; i<basis.size(); i++)
+            {
+               q.Add(-(A_basis[i] * x), basis[i]);
+            }
+            A.Mult(q, Aq);
+            const real_t norm2 = q * Aq;
+            if (norm2 <= 0.0) { break; } // x is in the span already
+            const real_t scale = 1.0 / std::sqrt(norm2);
+            q *= scale;
+            Aq *= scale;
+            basis.push_back(std::move(q));
+            A_basis.push_back(std::move(Aq));
+            break;
+         }
+      }
+   }
+
+   /// Drop the data that depends on A. Previous solutions are kept for
+   /// PREVIOUS and EXTRAPOLATE.
+   void OperatorChanged()
+   {
+      basis.clear();
+      A_basis.clear();
+   }
+
+   /// Drop all stored data.
+   void Reset()
+   {
+      history.clear();
+      times.clear();
+      OperatorChanged();
+   }
+
+   /// Add the stored data to @a ckpt, with names starting with @a prefix.
+   void Save(Checkpoint &ckpt, const std::string &prefix) const
+   {
+      ckpt.Add(prefix + "times", times.data(), int(times.size()));
+      for (size_t i=0; i<history.size(); i++)
+      {
+         ckpt.Add(prefix + "history" + std::to_string(i), history[i]);
+      }
+      ckpt.Add(prefix + "basis_size", real_t(basis.size()));
+      for (size_t i=0; i<basis.size(); i++)
+      {
+         ckpt.Add(prefix + "basis" + std::to_string(i), basis[i]);
+         ckpt.Add(prefix + "A_basis" + std::to_string(i), A_basis[i]);
+      }
+   }
+
+   /// Replace the stored data with the one saved by Save(). The type is
+   /// kept.
+   void Load(const MappedCheckpoint &ckpt, const std::string &prefix)
+   {
+      Reset();
+      int n;
+      const real_t *t = ckpt.GetData(prefix + "times", n);
+      times.assign(t, t + n);
+      Vector v;
+      for (int i=0; i<n; i++)
+      {
+         ckpt.GetVector(prefix + "history" + std::to_string(i), v);
+         history.push_back(v);
+      }
+      const int nb = int(ckpt.GetScalar(prefix + "basis_size"));
+      for (int i=0; i<nb; i++)
+      {
+         ckpt.GetVector(prefix + "basis" + std::to_string(i), v);
+         basis.push_back(v);
+         ckpt.GetVector(prefix + "A_basis" + std::to_string(i), v);
+         A_basis.push_back(v);
+      }
+   }
+};
+
+/// @brief Reverse Cuthill-McKee ordering of the graph of A + A^T, which
+/// reduces the bandwidth. @a perm[i] is the old index of the new row i.
+///
+/// Each connected component starts from its unvisited node of least degree,
+/// and the neighbors of a node are visited in order of increasing degree.
+inline void ReverseCuthillMcKee(const SparseMatrix &A, Array<int> &perm)
+{
+   const int n = A.Height();
+   std::unique_ptr<SparseMatrix> At(Transpose(A));
+   const int *I = A.HostReadI(), *J = A.HostReadJ();
+   const int *It = At->HostReadI(), *Jt = At->HostReadJ();
+   std::vector<int> degree(n), by_degree(n);
+   for (int i=0; i<n; i++)
+   {
+      degree[i] = I[i+1] - I[i] + It[i+1] - It[i];
+      by_degree[i] = i;
+   }
+   std::stable_sort(by_degree.begin(), by_degree.end(),
+                    [&](int a, int b) { return degree[a] < degree[b]; });
+
+   std::vector<char> visited(n, 0);
+   std::vector<int> order, neighbors;
+   order.reserve(n);
+   for (int start : by_degree)
+   {
+      if (visited[start]) { continue; }
+      visited[start] = 1;
+      order.push_back(start);
+      for (size_t head = order.size() - 1; head < order.size(); head++)
+      {
+         const int u = order[head];
+         neighbors.clear();
+         auto visit = [&](int v)
+         {
+            if (!visited[v]) { visited[v] = 1; neighbors.push_back(v); }
+         };
+         for (int p = I[u]; p < I[u+1]; p++) { visit(J[p]); }
+         for (int p = It[u]; p < It[u+1]; p++) { visit(Jt[p]); }
+         std::stable_sort(neighbors.begin(), neighbors.end(),
+                          [&](int a, int b) { return degree[a] < degree[b]; });
+         order.insert(order.end(), neighbors.begin(), neighbors.end());
+      }
+   }
+   perm.SetSize(n);
+   for (int i=0; i<n; i++) { perm[i] = order[n - 1 - i]; }
+}
+
+/// @brief Order the unknowns by increasing @a s, e.g. s = beta . x at the
+/// dof locations for a flow-aligned (downwind) ordering, in which upwind
+/// unknowns come first. Ties keep their order. @a perm[i] is the old index
+/// of the new row i.
+inline void DownwindOrdering(const Vector &s, Array<int> &perm)
+{
+   perm.SetSize(s.Size());
+   for (int i=0; i<s.Size(); i++) { perm[i] = i; }
+   const real_t *sd = s.HostRead();
+   std::stable_sort(perm.begin(), perm.end(),
+                    [sd](int a, int b) { return sd[a] < sd[b]; });
+}
+
+/// @brief New matrix P A P^T with rows and columns permuted by @a perm:
+/// entry (i, j) is A(perm[i], perm[j]). Columns are sorted in each row.
+inline SparseMatrix *PermuteSparseMatrix(const SparseMatrix &A,
+                                         const Array<int> &perm)
+{
+   const int n = A.Height();
+   MFEM_VERIFY(A.Width() == n && perm.Size() == n,
+               "the matrix must be square and match the permutation");
+   const int *AI = A.HostReadI(), *AJ = A.HostReadJ();
+   const real_t *AD = A.HostReadData();
+   std::vector<int> iperm(n);
+   for (int i=0; i<n; i++) { iperm[perm[i]] = i; }
+
+   int *I = new int[n+1];
+   int *J = new int[A.NumNonZeroElems()];
+   real_t *data = new real_t[A.NumNonZeroElems()];
+   typedef std::pair<int, real_t> Entry;
+   std::vector<Entry> row;
+   I[0] = 0;
+   for (int i=0; i<n; i++)
+   {
+      const int old = perm[i];
+      row.clear();
+      for (int p = AI[old]; p < AI[old+1]; p++)
+      {
+         row.emplace_back(iperm[AJ[p]], AD[p]);
+      }
+      std::sort(row.begin(), row.end(), [](const Entry &a, const Entry &b)
+      {
+         return a.first < b.first;
+      });
+      I[i+1] = I[i] + int(row.size());
+      for (size_t k=0; k<row.size(); k++)
+      {
+         J[I[i] + k] = row[k].first;
+         data[I[i] + k] = row[k].second;
+      }
+   }
+   return new SparseMatrix(I, J, data, n, n);
+}
+
+/// @brief Largest distance |i - j| of a nonzero entry from the diagonal.
+inline int MatrixBandwidth(const SparseMatrix &A)
+{
+   const int *I = A.HostReadI(), *J = A.HostReadJ();
+   int bandwidth = 0;
+   for (int i=0; i<A.Height(); i++)
+   {
+      for (int p = I[i]; p < I[i+1]; p++)
+      {
+         bandwidth = std::max(bandwidth, std::abs(J[p] - i));
+      }
+   }
+   return bandwidth;
+}
+
+/// @brief Incomplete LU factorization with level of fill k of a finalized
+/// SparseMatrix.
+///
+/// ILU(0) keeps the pattern of A; ILU(k) also keeps the fill entries whose
+/// level, the length of the shortest fill path, is at most k. The quality
+/// depends on the ordering of the unknowns: for convection-dominated
+/// problems, an ordering along the flow makes the factors close to exact.
+/// Mult() applies (LU)^{-1} with a forward and a backward substitution.
+class ILUK : public Solver
+{
+   int level;
+   std::vector<int> I, J, diag; // CSR of L + U, position of each diagonal
+   std::vector<real_t> data;
+
+public:
+   ILUK(int level = 0): Solver(0), level(level) {}
+
+   ILUK(const SparseMatrix &A, int level = 0): ILUK(level) { SetOperator(A); }
+
+   void SetOperator(const Operator &op) override
+   {
+      const SparseMatrix *A = dynamic_cast<const SparseMatrix*>(&op);
+      MFEM_VERIFY(A && A->Finalized() && A->Height() == A->Width(),
+                  "ILUK requires a square, finalized SparseMatrix");
+      height = width = A->Height();
+      const int n = height;
+      const int *AI = A->HostReadI(), *AJ = A->HostReadJ();
+      const real_t *AD = A->HostReadData();
+
+      // Symbolic factorization: the pattern of row i is that of A, plus
+      // the fill from the U rows of its lower entries, in increasing order
+      I.assign(1, 0);
+      J.clear();
+      diag.resize(n);
+      std::vector<int> levels; // level of each entry of J
+      std::vector<int> lev(n, -1); // level in the current row, -1 if absent
+      std::vector<int> cols;
+      std::priority_queue<int, std::vector<int>, std::greater<int>> lower;
+      for (int i=0; i<n; i++)
+      {
+         cols.clear();
+         auto insert = [&](int j, int l)
+         {
+            if (lev[j] < 0)
+            {
+               lev[j] = l;
+               cols.push_back(j);
+               if (j < i) { lower.push(j); }
+            }
+            else { lev[j] = std::min(lev[j], l); }
+         };
+         for (int p = AI[i]; p < AI[i+1]; p++) { insert(AJ[p], 0); }
+         insert(i, 0);
+         while (!lower.empty())
+         {
+            const int k = lower.top();
+            lower.pop();
+            for (int p = diag[k] + 1; p < I[k+1]; p++)
+            {
+               const int l = lev[k] + levels[p] + 1;
+               if (l <= level) { insert(J[p], l); }
+            }
+         }
+         std::sort(cols.begin(), cols.end());
+         for (int j : cols)
+         {
+            if (j == i) { diag[i] = int(J.size()); }
+            J.push_back(j);
+            levels.push_back(lev[j]);
+            lev[j] = -1;
+         }
+         I.push_back(int(J.size()));
+      }
+
+      // Numeric factorization, row by row (IKJ variant)
+      data.assign(J.size(), 0.0);
+      std::vector<int> pos(n, -1);
+      for (int i=0; i<n; i++)
+      {
+         for (int p = I[i]; p < I[i+1]; p++) { pos[J[p]] = p; }
+         for (int p = AI[i]; p < AI[i+1]; p++) { data[pos[AJ[p]]] += AD[p]; }
+         for (int p = I[i]; p < diag[i]; p++)
+         {
+            const int k = J[p];
+            const real_t l_ik = data[p] /= data[diag[k]];
+            for (int q = diag[k] + 1; q < I[k+1]; q++)
+            {
+               if (pos[J[q]] >= 0) { data[pos[J[q]]] -= l_ik*data[q]; }
+            }
+         }
+         MFEM_VERIFY(data[diag[i]] != 0.0, "zero pivot in row " << i);
+         for (int p = I[i]; p < I[i+1]; p++) { pos[J[p]] = -1; }
+      }
+   }
+
+   void Mult(const Vector &b, Vector &x) const override
+   {
+      const int n = height;
+      const real_t *bd = b.HostRead();
+      real_t *xd = x.HostWrite();
+      // L y = b, with unit diagonal
+      for (int i=0; i<n; i++)
+      {
+         real_t s = bd[i];
+         for (int p = I[i]; p < diag[i]; p++) { s -= data[p]*xd[J[p]]; }
+         xd[i] = s;
+      }
+      // U x = y
+      for (int i = n-1; i >= 0; i--)
+      {
+         real_t s = xd[i];
+         for (int p = diag[i] + 1; p < I[i+1]; p++) { s -= data[p]*xd[J[p]]; }
+         xd[i] = s / data[diag[i]];
+      }
+   }
+
+   /// Number of entries of L + U.
+   int NumNonZeroElems() const { return int(J.size()); }
+};
+
+/// @brief CG with double-precision iterative refinement around inner
+/// iterations in single precision, for a symmetric positive definite,
+/// finalized SparseMatrix.
+///
+/// SetOperator() keeps a float copy of the matrix values and of the inverse
+/// diagonal; the row offsets and column indices are those of the matrix,
+/// which must outlive the solver. Mult() computes the residual r = b - A x in
+/// double precision, solves A d = r approximately with symmetric
+/// Gauss-Seidel preconditioned CG in float, adds d to x, and repeats until
+/// the double residual meets the tolerances. The inner iterations stream 8
+/// instead of 12 bytes per nonzero; the dot products are accumulated in
+/// double. GetNumIterations() counts the inner iterations.
+class MixedPrecisionCG : public IterativeSolver
+{
+   const SparseMatrix *A = nullptr;
+   std::vector<float> values, inv_diag;
+   real_t inner_tol = 1e-4;
+   int max_refinements = 20;
+   mutable int num_refinements = 0;
+   mutable std::vector<float> rhs, d, r, z, p, q;
+   mutable Vector res;
+
+   static double Dot(const std::vector<float> &a, const std::vector<float> &b)
+   {
+      double s = 0.0;
+      for (size_t i=0; i<a.size(); i++) { s += double(a[i])*b[i]; }
+      return s;
+   }
+
+   // y = A x in float
+   void FloatMult(const std::vector<float> &x, std::vector<float> &y) const
+   {
+      const int *I = A->HostReadI(), *J = A->HostReadJ();
+      for (int i=0; i<height; i++)
+      {
+         float s = 0.0f;
+         for (int k = I[i]; k < I[i+1]; k++) { s += values[k]*x[J[k]]; }
+         y[i] = s;
+      }
+   }
+
+   // One forward and one backward Gauss-Seidel sweep from zero, as
+   // GSSmoother does by default
+   void FloatSGS(const std::vector<float> &b, std::vector<float> &x) const
+   {
+      const int *I = A->HostReadI(), *J = A->HostReadJ();
+      std::fill(x.begin(), x.end(), 0.0f);
+      auto relax = [&](int i)
+      {
+         float s = b[i];
+         for (int k = I[i]; k < I[i+1]; k++)
+         {
+            if (J[k] != i) { s -= values[k]*x[J[k]]; }
+         }
+         x[i] = s*inv_diag[i];
+      };
+      for (int i=0; i<height; i++) { relax(i); }
+      for (int i=height-1; i>=0; i--) { relax(i); }
+   }
+
+   // Solve A d = rhs to the inner tolerance from d = 0; returns the number
+   // of iterations.
+   int FloatPCG(int max_it) const
+   {
+      std::fill(d.begin(), d.end(), 0.0f);
+      r = rhs;
+      FloatSGS(r, z);
+      p = z;
+      double nom = Dot(r, z);
+      const double stop = inner_tol*inner_tol*Dot(r, r);
+      int it = 0;
+      while (it < max_it && nom > 0.0)
+      {
+         FloatMult(p, q);
+         const float alpha = float(nom / Dot(p, q));
+         for (int i=0; i<height; i++)
+         {
+            d[i] += alpha*p[i];
+            r[i] -= alpha*q[i];
+         }
+         it++;
+         if (Dot(r, r) <= stop) { break; }
+         FloatSGS(r, z);
+         const double nom_new = Dot(r, z);
+         const float beta = float(nom_new / nom);
+         nom = nom_new;
+         for (int i=0; i<height; i++) { p[i] = z[i] + beta*p[i]; }
+      }
+      return it;
+   }
+
+public:
+   MixedPrecisionCG() = default;
+
+   void SetOperator(const Operator &op) override
+   {
+      A = dynamic_cast<const SparseMatrix*>(&op);
+      MFEM_VERIFY(A && A->Finalized() && A->Height() == A->Width(),
+                  "MixedPrecisionCG requires a square, finalized SparseMatrix");
+      oper = A;
+      height = width = A->Height();
+      const int *I = A->HostReadI(), *J = A->HostReadJ();
+      const real_t *data = A->HostReadData();
+      values.assign(data, data + A->NumNonZeroElems());
+      inv_diag.assign(height, 0.0f);
+      for (int i=0; i<height; i++)
+      {
+         for (int k = I[i]; k < I[i+1]; k++)
+         {
+            if (J[k] == i) { inv_diag[i] = float(1.0/data[k]); }
+         }
+         MFEM_VERIFY(inv_diag[i] != 0.0f, "zero diagonal in row " << i);
+      }
+      for (auto *v : {&rhs, &d, &r, &z, &p, &q}) { v->resize(height); }
+      res.SetSize(height);
+   }
+
+   /// Relative residual reduction of each inner float solve. Values much
+   /// below 1e-6 cannot be reached in single precision.
+   void SetInnerTolerance(real_t tol) { inner_tol = tol; }
+
+   /// Maximum number of refinement steps, i.e. of inner solves.
+   void SetMaxRefinements(int n) { max_refinements = n; }
+
+   /// Number of refinement steps of the last Mult().
+   int GetNumRefinements() const { return num_refinements; }
+
+   /// Bytes of the float copy of the values, the inverse diagonal and the
+   /// work vectors.
+   size_t MemoryBytes() const
+   {
+      return (values.size() + 7*size_t(height))*sizeof(float) +
+             size_t(height)*sizeof(real_t);
+   }
+
+   void Mult(const Vector &b, Vector &x) const override
+   {
+      MFEM_VERIFY(A, "MixedPrecisionCG: the operator is not set");
+      if (!iterative_mode) { x = 0.0; }
+      const real_t tol = std::max(rel_tol*b.Norml2(), abs_tol);
+      final_iter = 0;
+      num_refinements = 0;
+      converged = false;
+      while (true)
+      {
+         A->Mult(x, res);
+         add(b, -1.0, res, res);
+         final_norm = res.Norml2();
+         if (final_norm <= tol) { converged = true; break; }
+         if (num_refinements == max_refinements || final_iter >= max_iter)
+         {
+            break;
+         }
+         // The residual is scaled to unit norm, the range where float keeps
+         // its relative precision
+         const real_t *rd = res.HostRead();
+         for (int i=0; i<height; i++) { rhs[i] = float(rd[i]/final_norm); }
+         final_iter += FloatPCG(max_iter - final_iter);
+         real_t *xd = x.HostReadWrite();
+         for (int i=0; i<height; i++) { xd[i] += final_norm*d[i]; }
+         num_refinements++;
+      }
+      if (!converged && print_options.warnings)
+      {
+         mfem::out << "MixedPrecisionCG: no convergence after "
+                   << num_refinements << " refinements, residual "
+                   << final_norm << '\n';
+      }
+   }
+};
+
+/// @brief Inverse of the mass matrix of a discontinuous (L2) space, applied
+/// element by element.
+///
+/// The inverses of the element mass matrices are computed once and stored
+/// one after another in a DenseTensor. The dofs of an element are
+/// contiguous in an L2 space, so Mult() is a batch of small dense
+/// matrix-vector products on contiguous blocks of x and y, with no global
+/// solve. All elements must have the same number of dofs.
+class BlockDiagonalMassInverse : public Solver
+{
+   DenseTensor inv; // column-major inverse of each element mass matrix
+   Array<int> offsets; // first dof of each element
+
+public:
+   BlockDiagonalMassInverse(FiniteElementSpace &fes, Coefficient *rho = nullptr)
+      : Solver(fes.GetVSize())
+   {
+      MFEM_VERIFY(dynamic_cast<const L2_FECollection*>(fes.FEColl()) &&
+                  fes.GetVDim() == 1,
+                  "BlockDiagonalMassInverse requires a scalar L2 space");
+      const int ne = fes.GetNE();
+      const int n = ne > 0 ? fes.GetFE(0)->GetDof() : 0;
+      inv.SetSize(n, n, ne);
+      offsets.SetSize(ne);
+      std::unique_ptr<MassIntegrator> mass(rho ? new MassIntegrator(*rho)
+                                           : new MassIntegrator);
+      DenseMatrix elmat;
+      Array<int> dofs;
+      for (int e=0; e<ne; e++)
+      {
+         fes.GetElementDofs(e, dofs);
+         MFEM_VERIFY(dofs.Size() == n, "elements with different numbers of "
+                     "dofs are not supported");
+         for (int i=1; i<n; i++)
+         {
+            MFEM_VERIFY(dofs[i] == dofs[0] + i, "element dofs not contiguous");
+         }
+         offsets[e] = dofs[0];
+         mass->AssembleElementMatrix(*fes.GetFE(e),
+                                     *fes.GetElementTransformation(e), elmat);
+         elmat.Invert();
+         std::copy(elmat.Data(), elmat.Data() + n*n, inv.GetData(e));
+      }
+   }
+
+   void SetOperator(const Operator &) override {}
+
+   void Mult(const Vector &x, Vector &y) const override
+   {
+      const int n = inv.SizeI(), ne = inv.SizeK();
+      const real_t *xd = x.HostRead(), *Minv = inv.HostRead();
+      real_t *yd = y.HostWrite();
+      for (int e=0; e<ne; e++)
+      {
+         const real_t *A = Minv + size_t(e)*n*n;
+         const real_t *xe = xd + offsets[e];
+         real_t *ye = yd + offsets[e];
+         for (int i=0; i<n; i++) { ye[i] = 0.0; }
+         for (int j=0; j<n; j++)
+         {
+            const real_t xj = xe[j];
+            for (int i=0; i<n; i++) { ye[i] += A[i + j*n]*xj; }
+         }
+      }
+   }
+
+   /// Bytes of the stored inverses.
+   size_t MemoryBytes() const { return size_t(inv.TotalSize())*sizeof(real_t); }
+};
 } // namespace mfem
 #endif